@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../kernel.h"
+#include "../kinclude/ktypes.h"
+#include "../kinclude/ecall.h"
+#include "../kinclude/sched.h"
+#include "../kinclude/malloc.h"
+#include "host.h"
+
+// Microbenchmarks of the scheduler and the allocator. Every benchmark runs in
+// a forked child on a freshly booted kernel, the harness plays the processes
+// on hart 0. Times include the simulated trap entry and exit, but not the
+// register save and restore of boot.S.
+
+#define ROUNDS 20000
+
+// a word the waiting threads block on, it is on the stack of the root
+// process so every thread may access it
+static int futex_word;
+
+static double now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char* name, double start, long ops)
+{
+    printf("  %-24s %10.1f ns/op  (%ld ops)\n", name, (now_ns() - start) / ops, ops);
+}
+
+static optional_int ecall(int code, int a0, int a1, int a2)
+{
+    optional_int res;
+    if (host_ecall(0, code, a0, a1, a2, 0, 0, &res) == HOST_HALTED) {
+        printf("kernel halted with code %d\n", host_halt_code);
+        exit(1);
+    }
+    return res;
+}
+
+// the value of an ecall that is expected to succeed
+static int must(optional_int res, const char* what)
+{
+    if (has_error(res)) {
+        printf("%s failed with error %d\n", what, res.error);
+        exit(1);
+    }
+    return res.value;
+}
+
+// boot and fill the process table with runnable threads of the root process,
+// returns the root process
+static struct process_control_block* boot_with_threads(int threads)
+{
+    if (host_boot() == HOST_HALTED) {
+        printf("boot failed with code %d\n", host_halt_code);
+        exit(1);
+    }
+
+    struct process_control_block* root = host_running[0];
+
+    futex_word = (int) root->stack_top - 4;
+
+    for (int i = 0; i < threads; i++)
+        must(ecall(ECALL_SPAWN, 0x10000, i, 0), "spawn");
+
+    return root;
+}
+
+// let every process except root block on futex_word
+static void block_all_but(struct process_control_block* root, int count)
+{
+    int blocked = 0;
+
+    while (blocked < count) {
+        if (host_running[0] == root) {
+            host_advance(TIME_SLICE_LEN);
+            host_timer(0);
+        } else {
+            must(ecall(ECALL_FUTEX_WAIT, futex_word, 0, 0), "futex_wait");
+            blocked++;
+        }
+    }
+
+    while (host_running[0] != root)
+        host_timer(0);
+}
+
+static void bench_pick_next()
+{
+    boot_with_threads(PROCESS_COUNT - 1);
+
+    double start = now_ns();
+    for (int i = 0; i < ROUNDS; i++) {
+        host_advance(TIME_SLICE_LEN);
+        host_timer(0);
+    }
+    report("pick-next (preempt)", start, ROUNDS);
+
+    start = now_ns();
+    for (int i = 0; i < ROUNDS; i++)
+        must(ecall(ECALL_SLEEP, 0, 0, 0), "sleep");
+    report("ecall fast path", start, ROUNDS);
+}
+
+static void bench_wakeup()
+{
+    int threads = PROCESS_COUNT - 1;
+    struct process_control_block* root = boot_with_threads(threads);
+    long woken = 0;
+    double elapsed = 0;
+
+    // the root process wakes every waiting thread, then they block again
+    for (int i = 0; i < ROUNDS / threads + 1; i++) {
+        block_all_but(root, threads);
+
+        double start = now_ns();
+        woken += must(ecall(ECALL_FUTEX_WAKE, futex_word, threads, 0), "futex_wake");
+        elapsed += now_ns() - start;
+    }
+    printf("  %-24s %10.1f ns/op  (%ld ops)\n", "futex wakeup", elapsed / woken, woken);
+}
+
+static void bench_spawn_exit()
+{
+    // half of the table is taken, so slot search has to skip live processes
+    boot_with_threads(PROCESS_COUNT / 2 - 1);
+
+    double start = now_ns();
+    for (int i = 0; i < ROUNDS; i++) {
+        int pid = must(ecall(ECALL_SPAWN, 0x10000, 0, 0), "spawn");
+        must(ecall(ECALL_KILL, pid, 0, 0), "kill");
+    }
+    report("thread spawn + kill", start, ROUNDS);
+
+    start = now_ns();
+    for (int i = 0; i < ROUNDS; i++) {
+        int pid = must(ecall(ECALL_SPAWN_PROCESS, 2, 0, 0), "spawn_process");
+        must(ecall(ECALL_KILL, pid, 0, 0), "kill");
+    }
+    report("process spawn + kill", start, ROUNDS);
+}
+
+static void bench_allocator()
+{
+    enum { LIVE = 256 };
+    void* blocks[LIVE] = { 0 };
+    unsigned int rand_state = 1;
+
+    boot_with_threads(0);
+
+    double start = now_ns();
+    for (int i = 0; i < ROUNDS * 10; i++) {
+        rand_state = rand_state * 1103515245 + 12345;
+        int slot = (rand_state >> 8) % LIVE;
+
+        if (blocks[slot] != NULL) {
+            free_block(blocks[slot]);
+            blocks[slot] = NULL;
+        } else {
+            optional_voidptr block = malloc_block(16 << ((rand_state >> 20) % 12));
+            blocks[slot] = has_error(block) ? NULL : block.value;
+        }
+    }
+    report("malloc_block / free_block", start, ROUNDS * 10);
+
+    start = now_ns();
+    for (int i = 0; i < ROUNDS * 10; i++) {
+        size_t size = USER_STACK_SIZE;
+        optional_voidptr stack = malloc_stack(&size);
+
+        if (has_value(stack))
+            free_stack(stack.value, size);
+    }
+    report("malloc_stack / free_stack", start, ROUNDS * 10);
+
+    start = now_ns();
+    for (int i = 0; i < ROUNDS; i++) {
+        int region = must(ecall(ECALL_MMAP, 4096, 0, 0), "mmap");
+        must(ecall(ECALL_MUNMAP, region, 0, 0), "munmap");
+    }
+    report("mmap + munmap", start, ROUNDS);
+}
+
+static void run(void (*bench)())
+{
+    fflush(stdout);
+    if (fork() == 0) {
+        bench();
+        fflush(stdout);
+        _exit(0);
+    }
+
+    int status;
+    wait(&status);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        printf("  benchmark failed (status %x)\n", status);
+}
+
+int main()
+{
+    printf("PROCESS_COUNT=%d HART_COUNT=%d\n", PROCESS_COUNT, HART_COUNT);
+    run(bench_pick_next);
+    run(bench_wakeup);
+    run(bench_spawn_exit);
+    run(bench_allocator);
+    return 0;
+}
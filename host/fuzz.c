@@ -0,0 +1,414 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "../kernel.h"
+#include "../kinclude/ktypes.h"
+#include "../kinclude/ecall.h"
+#include "../kinclude/sched.h"
+#include "host.h"
+
+// Drives the kernel with random ecalls, timer interrupts and inter-processor
+// interrupts on all harts and checks the scheduler state after every step.
+// Each seed runs in a forked child on a freshly booted kernel, so a crash is
+// reported with the seed that reproduces it.
+//
+// usage: fuzz <first seed> <last seed> [steps]
+//
+// Pointer arguments point into the memory of the calling process or are
+// invalid in a way the kernel has to detect, there is no memory protection on
+// the host. Ring ecalls are left out, their entries would need valid pointers
+// as well.
+
+#define POOL_SIZE 16
+
+static unsigned int rand_state;
+static int step;
+
+// the top of the stack of the process at the root of the calling thread, the
+// simulated processes pass pointers into it to the kernel. All threads of a
+// process can access it, so its first words are used as futexes.
+static int* user_mem;
+#define USER_MEM_WORDS 256
+#define FUTEX_WORDS 8
+
+// values returned by the kernel, used as arguments of later ecalls
+static int pids[POOL_SIZE];
+static int channels[POOL_SIZE];
+static int regions[POOL_SIZE];
+
+static unsigned int rnd(unsigned int n)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state % n;
+}
+
+static void fail(const char* msg)
+{
+    printf("step %d: %s\n", step, msg);
+
+    for (int hart = 0; hart < HART_COUNT; hart++) {
+        printf("  hart %d: pid %d, timecmp %lld, ipi %d\n", hart,
+               host_running[hart] ? host_running[hart]->pid : -1,
+               (long long) host_timecmp[hart], host_ipi_pending[hart]);
+    }
+    for (int i = 0; i < PROCESS_COUNT; i++) {
+        if (processes[i].status != PROC_DEAD)
+            printf("  pid %d: status %d\n", processes[i].pid, processes[i].status);
+    }
+    fflush(stdout);
+    _exit(2);
+}
+
+static void remember(int* pool, int value)
+{
+    pool[rnd(POOL_SIZE)] = value;
+}
+
+// a value from the pool, sometimes a random one
+static int pick(int* pool)
+{
+    if (rnd(8) == 0)
+        return (int) rnd(PROCESS_COUNT * 2) - 1;
+    return pool[rnd(POOL_SIZE)];
+}
+
+static int pick_timeout()
+{
+    int timeouts[] = { 0, 1, TIME_SLICE_LEN, 5 * TIME_SLICE_LEN, -1 };
+
+    return timeouts[rnd(sizeof(timeouts) / sizeof(*timeouts))];
+}
+
+// a pointer into user_mem with len bytes after it, or an invalid one. Valid
+// pointers are aligned for struct sched_stats.
+static int pick_pointer(int len)
+{
+    switch (rnd(16)) {
+        case 0: return 0;
+        case 1: return (int) user_mem + 2;
+        case 2: return END_OF_USABLE_MEM;
+        case 3: return -4;
+    }
+    return (int) (user_mem + 2 * rnd((USER_MEM_WORDS * 4 - len) / 8));
+}
+
+static int pick_futex()
+{
+    if (rnd(8) == 0)
+        return pick_pointer(4);
+    return (int) (user_mem + rnd(FUTEX_WORDS));
+}
+
+static void check_exit(enum host_exit exit)
+{
+    if (exit != HOST_HALTED)
+        return;
+
+    // every process exited or waits without a timeout
+    if (host_halt_code == 22)
+        _exit(0);
+
+    printf("step %d: kernel halted with code %d\n", step, host_halt_code);
+    fflush(stdout);
+    _exit(3);
+}
+
+static void random_ecall(int hart)
+{
+    int code = 1 + rnd(ECALL_COUNT - 1);
+    int a[5] = { 0 };
+    optional_int res;
+    struct process_control_block* root = host_running[hart];
+
+    // a killed process is stopped as soon as it enters the kernel, its
+    // memory might already be gone
+    if (root->status != PROC_RDY) {
+        check_exit(host_ecall(hart, ECALL_SLEEP, 0, 0, 0, 0, 0, &res));
+        return;
+    }
+
+    while (root->parent != NULL)
+        root = root->parent;
+    user_mem = (int*) root->stack_top - USER_MEM_WORDS;
+
+    // killing processes ends a run quickly, spawn more often instead
+    if ((code == ECALL_EXIT || code == ECALL_KILL) && rnd(4) != 0)
+        code = rnd(2) ? ECALL_SPAWN : ECALL_SPAWN_PROCESS;
+
+    switch (code) {
+        case ECALL_SPAWN:
+            a[0] = 0x10000;
+            a[1] = rnd(100);
+            a[2] = (int[]) { 0, 256, 4096, 1 << 20, -1 }[rnd(5)];
+            break;
+        case ECALL_SLEEP:
+            a[0] = pick_timeout();
+            break;
+        case ECALL_JOIN:
+            a[0] = pick(pids);
+            a[1] = pick_timeout();
+            break;
+        case ECALL_KILL:
+        case ECALL_EXIT:
+            a[0] = pick(pids);
+            break;
+        case ECALL_SET_SCHED:
+            a[0] = rnd(2) ? 0 : pick(pids);
+            a[1] = rnd(3);
+            a[2] = (int) rnd(40) - 4;
+            break;
+        case ECALL_FUTEX_WAIT:
+            a[0] = pick_futex();
+            a[1] = rnd(2) ? user_mem[rnd(FUTEX_WORDS)] : (int) rnd(3);
+            a[2] = pick_timeout();
+            break;
+        case ECALL_FUTEX_WAKE:
+            a[0] = pick_futex();
+            a[1] = (int) rnd(PROCESS_COUNT + 1) - 1;
+            break;
+        case ECALL_CHAN_CREATE:
+            a[0] = (int) rnd(11) - 1;
+            break;
+        case ECALL_CHAN_SEND:
+            a[0] = pick(channels);
+            a[1] = rnd(1000);
+            a[3] = rnd(256);
+            a[2] = pick_pointer(a[3]);
+            a[4] = pick_timeout();
+            break;
+        case ECALL_CHAN_RECV:
+            a[0] = pick(channels);
+            a[1] = pick_timeout();
+            break;
+        case ECALL_CHAN_CLOSE:
+            a[0] = pick(channels);
+            break;
+        case ECALL_RING_SETUP:
+        case ECALL_RING_ENTER:
+            // the process stores to one of its futex words instead
+            user_mem[rnd(FUTEX_WORDS)] = rnd(3);
+            return;
+        case ECALL_SBRK:
+            a[0] = (int[]) { 0, 4, 100, 4096, -4, -4096, 1 << 20 }[rnd(7)];
+            break;
+        case ECALL_MMAP:
+            a[0] = (int[]) { 0, 1, 100, 4096, 1 << 16, 1 << 26, -1 }[rnd(7)];
+            break;
+        case ECALL_MUNMAP:
+            a[0] = rnd(8) ? regions[rnd(POOL_SIZE)] : pick_pointer(4);
+            break;
+        case ECALL_SET_AFFINITY:
+            a[0] = rnd(2) ? 0 : pick(pids);
+            a[1] = rnd(1 << (HART_COUNT + 1));
+            break;
+        case ECALL_SPAWN_PROCESS:
+            a[0] = rnd(HOST_BINARY_COUNT + 2);
+            a[1] = rnd(100);
+            break;
+        case ECALL_GETSTATS:
+            a[0] = rnd(2) ? 0 : pick(pids);
+            a[1] = pick_pointer(sizeof(struct sched_stats));
+            break;
+        case ECALL_WRITE:
+            a[0] = rnd(4);
+            a[2] = rnd(256);
+            a[1] = pick_pointer(a[2]);
+            break;
+    }
+
+    check_exit(host_ecall(hart, code, a[0], a[1], a[2], a[3], a[4], &res));
+
+    if (has_error(res))
+        return;
+
+    switch (code) {
+        case ECALL_SPAWN:
+        case ECALL_SPAWN_PROCESS:
+            remember(pids, res.value);
+            break;
+        case ECALL_CHAN_CREATE:
+            remember(channels, res.value);
+            break;
+        case ECALL_MMAP:
+            remember(regions, res.value);
+            break;
+    }
+}
+
+static int host_runs(struct process_control_block* pcb)
+{
+    for (int hart = 0; hart < HART_COUNT; hart++) {
+        if (host_running[hart] == pcb)
+            return 1;
+    }
+    return 0;
+}
+
+// if a hart runs a dying process started by pcb, directly or through threads
+static int host_runs_thread_of(struct process_control_block* pcb)
+{
+    for (int i = 0; i < PROCESS_COUNT; i++) {
+        if (processes[i].dying && processes[i].parent == pcb &&
+            (host_runs(processes + i) || host_runs_thread_of(processes + i)))
+            return 1;
+    }
+    return 0;
+}
+
+// the scheduler state that has to hold whenever the kernel is left
+static void check_invariants()
+{
+    int all_idle = 1;
+
+    for (int hart = 0; hart < HART_COUNT; hart++) {
+        struct process_control_block* pcb = host_running[hart];
+
+        if (pcb == NULL)
+            continue;
+
+        all_idle = 0;
+
+        if (pcb < processes || pcb >= processes + PROCESS_COUNT)
+            fail("hart runs something outside of the process table");
+
+        // a process stopped from another hart runs until the ipi arrives
+        if (pcb->status != PROC_RDY && !host_ipi_pending[hart])
+            fail("hart runs a process that is not ready");
+
+        // its memory is only released once the hart left it
+        if (pcb->status == PROC_DEAD && !pcb->dying)
+            fail("hart runs a process whose memory was freed");
+
+        for (int other = hart + 1; other < HART_COUNT; other++) {
+            if (host_running[other] == pcb)
+                fail("two harts run the same process");
+        }
+    }
+
+    int ready = 0;
+
+    for (int i = 0; i < PROCESS_COUNT; i++) {
+        if (processes[i].dying && !host_runs(processes + i) && !host_runs_thread_of(processes + i))
+            fail("dead process keeps its memory");
+        if (processes[i].status == PROC_DEAD)
+            continue;
+        if (processes[i].status == PROC_RDY)
+            ready++;
+
+        for (int j = i + 1; j < PROCESS_COUNT; j++) {
+            if (processes[j].status != PROC_DEAD && processes[j].pid == processes[i].pid)
+                fail("two processes have the same pid");
+        }
+    }
+
+    if (!all_idle || ready == 0)
+        return;
+
+    // all harts idle with ready processes, something has to wake one of them
+    for (int hart = 0; hart < HART_COUNT; hart++) {
+        if (host_ipi_pending[hart] || host_timecmp[hart] != ~0ull)
+            return;
+    }
+
+    fail("ready processes but every hart sleeps forever");
+}
+
+// deliver the next interrupt when no hart runs a process
+static void next_interrupt()
+{
+    int next = -1;
+
+    for (int hart = 0; hart < HART_COUNT; hart++) {
+        if (host_running[hart] != NULL)
+            return;
+    }
+
+    for (int hart = 0; hart < HART_COUNT; hart++) {
+        if (host_ipi_pending[hart]) {
+            check_exit(host_ipi(hart));
+            return;
+        }
+        if (next == -1 || host_timecmp[hart] < host_timecmp[next])
+            next = hart;
+    }
+
+    if (host_timecmp[next] == ~0ull)
+        fail("no process runs and no interrupt is pending");
+
+    if (host_timecmp[next] > host_time)
+        host_advance(host_timecmp[next] - host_time);
+
+    check_exit(host_timer(next));
+}
+
+static void fuzz(unsigned int seed, int steps)
+{
+    rand_state = seed * 2654435761u + 1;
+
+    check_exit(host_boot());
+
+    for (step = 0; step < steps; step++) {
+        int hart = rnd(HART_COUNT);
+        int due;
+
+        switch (rnd(8)) {
+            case 0:
+                if (host_ipi_pending[hart])
+                    check_exit(host_ipi(hart));
+                break;
+            case 1:
+                due = host_advance(rnd(2 * TIME_SLICE_LEN));
+                if (due >= 0)
+                    check_exit(host_timer(due));
+                break;
+            default:
+                if (host_running[hart] != NULL)
+                    random_ecall(hart);
+                else if (rnd(4) == 0)
+                    next_interrupt();
+                break;
+        }
+
+        check_invariants();
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <first seed> <last seed> [steps]\n", argv[0]);
+        return 1;
+    }
+
+    unsigned int first = strtoul(argv[1], NULL, 0);
+    unsigned int last = strtoul(argv[2], NULL, 0);
+    int steps = argc > 3 ? atoi(argv[3]) : 10000;
+    int failed = 0;
+
+    for (unsigned int seed = first; seed <= last; seed++) {
+        fflush(stdout);
+        if (fork() == 0) {
+            fuzz(seed, steps);
+            _exit(0);
+        }
+
+        int status;
+        wait(&status);
+
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+            continue;
+
+        if (WIFSIGNALED(status))
+            printf("seed %u: killed by signal %d\n", seed, WTERMSIG(status));
+        else
+            printf("seed %u: failed\n", seed);
+        failed++;
+    }
+
+    printf("%u seeds, %d failed\n", last - first + 1, failed);
+    return failed != 0;
+}
@@ -0,0 +1,231 @@
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "../kernel.h"
+#include "../kinclude/ktypes.h"
+#include "../kinclude/csr.h"
+#include "../kinclude/sched.h"
+#include "../kinclude/ecall.h"
+#include "../kinclude/malloc.h"
+#include "../kinclude/loader.h"
+#include "../kinclude/pmp.h"
+#include "host.h"
+
+// The kernel stores addresses in ints and uint32s, so all memory it hands out
+// has to be below 2 GiB. The binary is linked without pie, which puts the
+// kernel globals there, and the allocator gets a fixed mapping at
+// HOST_MEM_START.
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE MAP_FIXED
+#endif
+
+int host_hart = 0;
+uint64 host_time = 1;
+
+struct process_control_block* host_running[HART_COUNT];
+uint64 host_timecmp[HART_COUNT];
+int host_ipi_pending[HART_COUNT];
+int host_halt_code = 0;
+
+// kernel code jumps back here instead of returning to user mode
+static jmp_buf host_exit_point;
+
+static int csrs[HART_COUNT][4096];
+
+/*
+ * Replacements for boot.S, csr.c and the linker script
+ */
+
+byte _ftext, _end, _ethread_fini;
+int thread_finalizer;
+
+void boot_memset(int value, void* start, void* end)
+{
+    for (byte* b = start; b < (byte*) end; b++)
+        *b = value;
+}
+
+int host_csr_read(int csr)
+{
+    return csrs[host_hart][csr & 0xfff];
+}
+
+void host_csr_write(int csr, int value)
+{
+    csrs[host_hart][csr & 0xfff] = value;
+}
+
+void host_halt(int code)
+{
+    host_halt_code = code;
+    longjmp(host_exit_point, HOST_HALTED);
+}
+
+void host_switch_to(struct process_control_block* pcb)
+{
+    host_running[host_hart] = pcb;
+    longjmp(host_exit_point, HOST_SWITCHED);
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+void kernel_idle(int* regs)
+{
+    host_running[host_hart] = NULL;
+    longjmp(host_exit_point, HOST_IDLE);
+}
+#pragma GCC diagnostic pop
+
+void write_mtimecmp(uint64 mtimecmp)
+{
+    host_timecmp[host_hart] = mtimecmp;
+}
+
+void send_ipi(int hart)
+{
+    host_ipi_pending[hart] = 1;
+}
+
+void clear_ipi()
+{
+    host_ipi_pending[host_hart] = 0;
+}
+
+/*
+ * Packaged binaries, normally written by package.py
+ */
+
+struct packaged_binary binary_table[PACKAGED_BINARY_COUNT];
+void* image_end;
+struct packed_image packed_image;
+
+static uint32 code_segment[64] = { 0x00000013 };
+static uint32 data_segment[4] = { 0x10010 };
+
+static struct image_segment zero_binary[] = {
+    { .offset = 0, .length = 1024, .source = NULL },
+};
+
+static struct image_segment code_binary[] = {
+    { .offset = 0, .length = sizeof(code_segment), .source = code_segment },
+    { .offset = 256, .length = sizeof(data_segment), .source = data_segment },
+    { .offset = 272, .length = 240, .source = NULL },
+};
+
+static uint32 code_binary_relocs[] = { 256 };
+
+/*
+ * Running the kernel
+ */
+
+static enum host_exit run_on(int hart, void (*entry)())
+{
+    host_hart = hart;
+
+    int exit = setjmp(host_exit_point);
+
+    if (exit == 0) {
+        entry();
+        exit = HOST_RESUMED;
+    }
+
+    return exit;
+}
+
+static void enter_ecall()
+{
+    // boot.S runs the scheduler when the fast path can't return
+    if (trap_handle_ecall_fast())
+        scheduler_run_next();
+}
+
+static void enter_boot()
+{
+    struct malloc_info info = {
+        .allocate_memory_start  = (void*) HOST_MEM_START,
+        .allocate_memory_end    = (void*) END_OF_USABLE_MEM,
+    };
+
+    pmp_init();
+    scheudler_init();
+    malloc_init(&info);
+
+    binary_table[0] = (struct packaged_binary) {
+        .binid = 1, .size = 1024,
+        .segment_count = sizeof(zero_binary) / sizeof(*zero_binary), .segments = zero_binary,
+    };
+    binary_table[1] = (struct packaged_binary) {
+        .binid = 2, .size = 512, .link_base = 0x10000,
+        .segment_count = sizeof(code_binary) / sizeof(*code_binary), .segments = code_binary,
+        .reloc_count = 1, .relocs = code_binary_relocs,
+    };
+
+    if (has_error(loader_spawn(1, 0, 0)))
+        host_halt(1);
+}
+
+enum host_exit host_boot()
+{
+    void* mem = mmap((void*) HOST_MEM_START, END_OF_USABLE_MEM - HOST_MEM_START, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+    if (mem != (void*) HOST_MEM_START) {
+        fprintf(stderr, "can't map the kernel memory at %x\n", HOST_MEM_START);
+        exit(1);
+    }
+
+    if (run_on(0, enter_boot) == HOST_HALTED)
+        return HOST_HALTED;
+
+    for (int hart = 0; hart < HART_COUNT; hart++) {
+        if (run_on(hart, scheduler_start) == HOST_HALTED)
+            return HOST_HALTED;
+    }
+
+    return HOST_SWITCHED;
+}
+
+enum host_exit host_ecall(int hart, int code, int a0, int a1, int a2, int a3, int a4, optional_int* result)
+{
+    struct process_control_block* pcb = host_running[hart];
+    int* args = pcb->regs + REG_A0;
+
+    args[0] = a0;
+    args[1] = a1;
+    args[2] = a2;
+    args[3] = a3;
+    args[4] = a4;
+    args[7] = code;
+
+    enum host_exit exit = run_on(hart, enter_ecall);
+
+    result->error = args[0];
+    result->value = args[1];
+
+    return exit;
+}
+
+enum host_exit host_timer(int hart)
+{
+    return run_on(hart, scheduler_handle_timer);
+}
+
+enum host_exit host_ipi(int hart)
+{
+    return run_on(hart, scheduler_handle_ipi);
+}
+
+int host_advance(uint64 ticks)
+{
+    host_time += ticks;
+
+    for (int hart = 0; hart < HART_COUNT; hart++) {
+        if (host_timecmp[hart] <= host_time)
+            return hart;
+    }
+
+    return -1;
+}
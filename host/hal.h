@@ -0,0 +1,46 @@
+#ifndef H_HOST_HAL
+#define H_HOST_HAL
+
+// Included by csr.h in the host build. The harts, their timers and control
+// and status registers are simulated by hal.c, the harness decides what the
+// simulated processes do (see host.h).
+
+// boot.S provides memset(value, start, end) to the kernel, the host version
+// is renamed so it doesn't replace the one of the c library
+#define memset boot_memset
+
+extern int host_hart;
+extern uint64 host_time;
+
+int host_csr_read(int csr);
+void host_csr_write(int csr, int value);
+void __attribute__((noreturn)) host_halt(int code);
+
+struct process_control_block;
+
+// replaces the register restore and mret at the end of scheduler_switch_to
+void __attribute__((noreturn)) host_switch_to(struct process_control_block* pcb);
+
+#define CSR_READ(csr_id, result) { \
+        (result) = host_csr_read((csr_id)); \
+}
+
+#define CSR_WRITE(csr_id, val) { \
+        host_csr_write((csr_id), (int) (val)); \
+}
+
+#define HALT(code) { \
+        host_halt((code)); \
+}
+
+static inline int hart_id()
+{
+    return host_hart;
+}
+
+static inline uint64 read_time()
+{
+    return host_time;
+}
+
+#endif
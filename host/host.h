@@ -0,0 +1,49 @@
+#ifndef H_HOST
+#define H_HOST
+
+#include "../kernel.h"
+#include "../kinclude/ktypes.h"
+
+// The harness side of the host build. Every call runs the kernel on one
+// simulated hart until it would return to user mode or go idle, the
+// simulated processes are driven by the caller.
+
+// how control came back from the kernel
+enum host_exit {
+    HOST_RESUMED = 1,   // the ecall fast path returned to the same process
+    HOST_SWITCHED,      // the scheduler switched to a process
+    HOST_IDLE,          // the hart went idle
+    HOST_HALTED,        // the kernel halted the machine, see host_halt_code
+};
+
+// the process running on each hart, NULL while it idles
+extern struct process_control_block* host_running[HART_COUNT];
+// the simulated mtime
+extern uint64 host_time;
+// the timer deadline of each hart
+extern uint64 host_timecmp[HART_COUNT];
+// pending inter-processor interrupts
+extern int host_ipi_pending[HART_COUNT];
+// the code passed to HALT
+extern int host_halt_code;
+
+// the packaged binaries, 1 is zero filled, 2 has a code segment and data
+// with a relocation
+#define HOST_BINARY_COUNT 2
+
+// set up memory and the kernel, start a process of binary 1 and start the
+// scheduler on every hart. Returns HOST_HALTED if that fails.
+enum host_exit host_boot();
+
+// the process running on hart issues an ecall, the result is stored in
+// *result. For a blocked process it is only final when it runs again.
+enum host_exit host_ecall(int hart, int code, int a0, int a1, int a2, int a3, int a4, optional_int* result);
+
+// interrupts on hart
+enum host_exit host_timer(int hart);
+enum host_exit host_ipi(int hart);
+
+// let time pass, returns the first hart whose timer is due or -1
+int host_advance(uint64 ticks);
+
+#endif
@@ -3,11 +3,47 @@
 
 // scheduler settings
 #define TIME_SLICE_LEN 10          // number of cpu time ticks per slice
+#define SCHED_RT_PRIORITIES 4      // number of real-time (SCHED_FIFO) priority levels
+#define SCHED_DEFAULT_WEIGHT 4     // weight of SCHED_FAIR processes, gives a slice of TIME_SLICE_LEN
+#define SCHED_MAX_WEIGHT 64        // largest weight a SCHED_FAIR process can have
 
-// set size of allocated stack for user processes
+// bitmask of harts that only run processes pinned to them with
+// ECALL_SET_AFFINITY, they never preempt these for anything else
+#define ISOLATED_HARTS 0
+
+// number of buckets in the futex wait queue table (must be a power of two)
+#define FUTEX_HASH_SIZE 16
+
+// number of channels and the maximum number of messages buffered per channel
+#define CHANNEL_COUNT 8
+#define CHANNEL_CAPACITY 8
+
+// size of the console output buffer of every process (must be a power of two)
+#define CONSOLE_BUFFER_SIZE 256
+
+// maximum number of entries in an ecall ring (must be a power of two)
+#define RING_MAX_ENTRIES 64
+
+// set size of allocated stack for user processes, threads can request any
+// size between MIN_STACK_SIZE and MAX_STACK_SIZE (rounded to a power of two)
 #define USER_STACK_SIZE (1 << 12)
+#define MIN_STACK_SIZE (1 << 8)
+#define MAX_STACK_SIZE (1 << 16)
+// number of freed stacks kept per size class for reuse
+#define STACK_CACHE_DEPTH 4
+
+// the lowest bytes of every stack are a guard region that user mode can't access
+#define STACK_GUARD_SIZE (1 << 6)
+
+// number of memory regions (mmap blocks and sbrk heaps) over all processes
+#define MEM_REGION_COUNT (PROCESS_COUNT * 4)
+// number of regions a single process can own, each one takes up a pmp entry
+#define MEM_REGIONS_PER_PROCESS 6
+// initial size of the sbrk heap of a process
+#define SBRK_MIN_HEAP (1 << 12)
 
-// init function
+// init functions, init_secondary is run by all harts except hart 0
 extern __attribute__((__noreturn__)) void init();
+extern __attribute__((__noreturn__)) void init_secondary();
 
 #endif
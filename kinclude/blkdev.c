@@ -0,0 +1,36 @@
+#include "blkdev.h"
+
+struct block_device* boot_device = NULL;
+
+#ifdef BLOCK_DEVICE_ADDR
+
+// A disk mapped into memory at BLOCK_DEVICE_ADDR. This can be a flash
+// (a pflash device on QEMU virt), or a RAM region the disk image is loaded
+// into as a stand-in (QEMU's generic loader device).
+static optional_int mmdisk_read(struct block_device* dev, uint32 block, uint32 count, void* dest)
+{
+    if (block >= dev->block_count || count > dev->block_count - block)
+        return (optional_int) { .error = EINVAL };
+
+    volatile uint32* from = (volatile uint32*) (BLOCK_DEVICE_ADDR + block * BLOCK_SIZE);
+    uint32* to = dest;
+
+    for (uint32 i = 0; i < count * (BLOCK_SIZE / 4); i++)
+        to[i] = from[i];
+
+    return (optional_int) { .value = count };
+}
+
+static struct block_device mmdisk = {
+    .block_count = BLOCK_DEVICE_BLOCKS,
+    .read = mmdisk_read
+};
+
+#endif
+
+void blkdev_init()
+{
+#ifdef BLOCK_DEVICE_ADDR
+    boot_device = &mmdisk;
+#endif
+}
@@ -0,0 +1,35 @@
+#ifndef H_BLKDEV
+#define H_BLKDEV
+
+#include "../kernel.h"
+#include "ktypes.h"
+
+// all block devices use this block size, package.py writes disks with it
+#define BLOCK_SIZE 512
+
+// if a memory mapped disk is present
+#ifdef BLOCK_DEVICE_ADDR
+
+#ifndef BLOCK_DEVICE_BLOCKS
+#error "When defining BLOCK_DEVICE_ADDR, please also provide BLOCK_DEVICE_BLOCKS, otherwise the disk has no size!"
+#endif
+
+#endif
+
+// a device that is read in whole blocks. Reads are synchronous and done under
+// the kernel lock, a driver for an asynchronous device has to wait for its
+// completion.
+struct block_device {
+    uint32 block_count;
+    // read count blocks starting at block into dest, returns the number of
+    // blocks read
+    optional_int (*read)(struct block_device* dev, uint32 block, uint32 count, void* dest);
+};
+
+// the device binaries are loaded from, NULL if there is none
+extern struct block_device* boot_device;
+
+// find the boot device, has to run before the loader reads its directory
+void blkdev_init();
+
+#endif
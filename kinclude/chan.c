@@ -0,0 +1,254 @@
+#include "../kernel.h"
+#include "ktypes.h"
+#include "chan.h"
+#include "sched.h"
+#include "csr.h"
+#include "malloc.h"
+#include "pmp.h"
+
+// Channels are bounded FIFO queues of messages. A message carries one data
+// word and optionally a buffer (pointer and length). Only the pointer is
+// queued, the buffer is handed over to the receiver without being copied and
+// the sender must not touch it anymore after sending it.
+//
+// Blocked senders keep their message in their pcb, blocked receivers get
+// the message written directly into their registers.
+//
+// If the buffer is a memory region allocated with mmap, the receiving process
+// becomes its owner when the message is delivered. Only regions of the
+// sending process can be sent.
+//
+// A channel belongs to the process that created it. Only that process and
+// its threads can close it, and it is closed when the process exits, so the
+// channel list doesn't fill up with channels nobody uses anymore. Queued
+// messages of an exiting sender that carry a buffer are dropped, the memory
+// they point to is gone.
+
+struct channel {
+    int open;
+    // pid of the root process of the creator
+    int owner;
+    int capacity;
+    // ring buffer of queued messages
+    int head;
+    int count;
+    struct chan_message messages[CHANNEL_CAPACITY];
+    // processes blocked in send or receive
+    struct wait_queue senders;
+    struct wait_queue receivers;
+};
+
+static struct channel channels[CHANNEL_COUNT];
+
+// channel ids are the index into the channel list plus one
+static struct channel* chan_from_id(int id)
+{
+    if (id < 1 || id > CHANNEL_COUNT)
+        return NULL;
+    return &channels[id - 1];
+}
+
+// channels belong to the root process, threads use them on its behalf
+static inline int chan_owner_of(struct process_control_block* pcb)
+{
+    while (pcb->parent != NULL)
+        pcb = pcb->parent;
+    return pcb->pid;
+}
+
+// block pcb on a wait queue of the channel
+static void chan_block(struct process_control_block* pcb, struct wait_queue* queue, int timeout)
+{
+    pcb->status = PROC_WAIT_CHAN;
+    wait_queue_add(queue, pcb);
+
+    // a timeout of zero waits forever
+    if (timeout > 0)
+        scheduler_set_timeout(pcb, read_time() + (unsigned int) timeout);
+}
+
+// hand a message to a blocked receiver and wake it up
+static void chan_deliver(struct process_control_block* receiver, struct chan_message* msg)
+{
+    malloc_transfer_region(msg->buf, msg->owner, receiver);
+    receiver->regs[REG_A0] = 0;
+    receiver->regs[REG_A0 + 1] = msg->data;
+    receiver->regs[REG_A0 + 2] = (int) msg->buf;
+    receiver->regs[REG_A0 + 3] = (int) msg->len;
+    scheduler_wake(receiver);
+}
+
+// fail all processes on a wait queue with the given error
+static void chan_fail_all(struct wait_queue* queue, int error)
+{
+    struct process_control_block* pcb;
+
+    while ((pcb = wait_queue_pop(queue)) != NULL) {
+        pcb->regs[REG_A0] = error;
+        pcb->regs[REG_A0 + 1] = 0;
+        scheduler_wake(pcb);
+    }
+}
+
+optional_int chan_create(struct process_control_block* pcb, int capacity)
+{
+    if (capacity < 0 || capacity > CHANNEL_CAPACITY)
+        return (optional_int) { .error = EINVAL };
+
+    for (int i = 0; i < CHANNEL_COUNT; i++) {
+        struct channel* chan = &channels[i];
+
+        if (chan->open)
+            continue;
+
+        chan->open = 1;
+        chan->owner = chan_owner_of(pcb);
+        chan->capacity = capacity;
+        chan->head = 0;
+        chan->count = 0;
+        return (optional_int) { .value = i + 1 };
+    }
+
+    return (optional_int) { .error = ENOBUFS };
+}
+
+int chan_send(struct process_control_block* pcb, int id, struct chan_message* msg, int timeout)
+{
+    struct channel* chan = chan_from_id(id);
+
+    if (chan == NULL || timeout < 0)
+        return EINVAL;
+    if (!chan->open)
+        return EPIPE;
+
+    // buffers must be memory of the sender, a region handed over with the
+    // message has to belong to it
+    if (msg->len > 0 && !pmp_user_range(pcb, msg->buf, msg->len))
+        return EINVAL;
+
+    msg->owner = malloc_transfer_owner(msg->buf, pcb);
+    msg->sender = pcb->pid;
+
+    if (msg->owner < 0)
+        return EINVAL;
+
+    // if a receiver is already waiting, hand the message over directly
+    struct process_control_block* receiver = wait_queue_pop(&chan->receivers);
+
+    if (receiver != NULL) {
+        chan_deliver(receiver, msg);
+        return 0;
+    }
+
+    // if there is space left, queue the message
+    if (chan->count < chan->capacity) {
+        int pos = (chan->head + chan->count) % chan->capacity;
+        chan->messages[pos] = *msg;
+        chan->count++;
+        return 0;
+    }
+
+    // otherwise wait until a receiver takes the message
+    pcb->chan_msg = *msg;
+    chan_block(pcb, &chan->senders, timeout);
+    return 0;
+}
+
+int chan_recv(struct process_control_block* pcb, int id, struct chan_message* msg, int timeout)
+{
+    struct channel* chan = chan_from_id(id);
+
+    if (chan == NULL || timeout < 0)
+        return EINVAL;
+    if (!chan->open)
+        return EPIPE;
+
+    struct process_control_block* sender = wait_queue_pop(&chan->senders);
+
+    if (chan->count > 0) {
+        // take the oldest queued message
+        *msg = chan->messages[chan->head];
+        chan->head = (chan->head + 1) % chan->capacity;
+        chan->count--;
+
+        // a blocked sender can now queue its message
+        if (sender != NULL) {
+            int pos = (chan->head + chan->count) % chan->capacity;
+            chan->messages[pos] = sender->chan_msg;
+            chan->count++;
+        }
+    } else if (sender != NULL) {
+        // unbuffered channel, take the message straight from the sender
+        *msg = sender->chan_msg;
+    } else {
+        // nothing to receive, wait for a sender
+        chan_block(pcb, &chan->receivers, timeout);
+        return 0;
+    }
+
+    malloc_transfer_region(msg->buf, msg->owner, pcb);
+
+    if (sender != NULL) {
+        sender->regs[REG_A0] = 0;
+        sender->regs[REG_A0 + 1] = 0;
+        scheduler_wake(sender);
+    }
+
+    return 0;
+}
+
+// close an open channel, queued messages are dropped, their buffers stay
+// with their last owner
+static void chan_shutdown(struct channel* chan)
+{
+    chan->open = 0;
+    chan->count = 0;
+    chan_fail_all(&chan->senders, EPIPE);
+    chan_fail_all(&chan->receivers, EPIPE);
+}
+
+int chan_close(struct process_control_block* pcb, int id)
+{
+    struct channel* chan = chan_from_id(id);
+
+    if (chan == NULL || !chan->open || chan->owner != chan_owner_of(pcb))
+        return EINVAL;
+
+    chan_shutdown(chan);
+    return 0;
+}
+
+// remove the queued messages of sender which carry a buffer, the order of
+// the remaining messages is kept
+static void chan_drop_messages(struct channel* chan, int sender)
+{
+    int kept = 0;
+
+    for (int i = 0; i < chan->count; i++) {
+        struct chan_message* msg = &chan->messages[(chan->head + i) % chan->capacity];
+
+        if (msg->sender == sender && msg->buf != NULL)
+            continue;
+
+        chan->messages[(chan->head + kept) % chan->capacity] = *msg;
+        kept++;
+    }
+
+    chan->count = kept;
+}
+
+void chan_release_process(struct process_control_block* pcb)
+{
+    for (int i = 0; i < CHANNEL_COUNT; i++) {
+        struct channel* chan = &channels[i];
+
+        if (!chan->open)
+            continue;
+
+        // threads don't own channels
+        if (pcb->parent == NULL && chan->owner == pcb->pid)
+            chan_shutdown(chan);
+        else
+            chan_drop_messages(chan, pcb->pid);
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef H_CHAN
+#define H_CHAN
+
+#include "../kernel.h"
+#include "ktypes.h"
+
+// create a channel buffering up to capacity messages, returns its id. The
+// channel belongs to the root process of pcb.
+optional_int chan_create(struct process_control_block* pcb, int capacity);
+
+// send a message, blocks pcb while the channel is full
+int chan_send(struct process_control_block* pcb, int id, struct chan_message* msg, int timeout);
+
+// receive a message into msg, blocks pcb while the channel is empty. If pcb
+// blocks, the message is delivered into its registers once it arrives.
+int chan_recv(struct process_control_block* pcb, int id, struct chan_message* msg, int timeout);
+
+// close a channel of the process of pcb, all blocked senders and receivers
+// fail with EPIPE
+int chan_close(struct process_control_block* pcb, int id);
+
+// close the channels of an exiting process and drop the buffers it still
+// has queued in other channels
+void chan_release_process(struct process_control_block* pcb);
+
+#endif
@@ -0,0 +1,141 @@
+#include "../kernel.h"
+#include "ktypes.h"
+#include "console.h"
+#include "sched.h"
+#include "io.h"
+
+// Every process has an output buffer, ECALL_WRITE only copies into it. The
+// buffers are written to the textIO device in whole lines when a hart has
+// nothing else to do, or right away when one fills up. A line longer than
+// TEXT_IO_BUFLEN is written as several device lines. This keeps the slow
+// device writes off the path of the writing process, and lines of different
+// processes from being mixed.
+
+#if (CONSOLE_BUFFER_SIZE & (CONSOLE_BUFFER_SIZE - 1)) != 0
+#error "CONSOLE_BUFFER_SIZE has to be a power of two!"
+#endif
+
+#define CONSOLE_MASK (CONSOLE_BUFFER_SIZE - 1)
+
+// head and tail count all bytes ever read and written, so they can wrap
+struct console_buffer {
+    unsigned int head;
+    unsigned int tail;
+    char data[CONSOLE_BUFFER_SIZE];
+};
+
+// indexed like the processes array
+static struct console_buffer console_buffers[PROCESS_COUNT];
+
+static inline struct console_buffer* console_buffer_of(struct process_control_block* pcb)
+{
+    return &console_buffers[pcb - processes];
+}
+
+// copy len bytes, a word at a time when both pointers allow it
+static void copy_bytes(char* dest, char* src, size_t len)
+{
+    if ((((uint32) dest ^ (uint32) src) & 3) == 0) {
+        while (len > 0 && ((uint32) dest & 3) != 0) {
+            *dest++ = *src++;
+            len--;
+        }
+
+        for (; len >= 4; len -= 4, dest += 4, src += 4)
+            *(uint32*) dest = *(uint32*) src;
+    }
+
+    while (len-- > 0)
+        *dest++ = *src++;
+}
+
+#ifdef TEXT_IO_ADDR
+
+// write the buffered bytes up to end to the console, one line per device
+// flush. A line is gathered into one chunk even if it wraps around the end of
+// the buffer. Lines longer than TEXT_IO_BUFLEN don't fit into the device,
+// they are split into pieces of TEXT_IO_BUFLEN bytes.
+static void console_drain(struct console_buffer* console, unsigned int end)
+{
+    char chunk[TEXT_IO_BUFLEN];
+
+    while (console->head != end) {
+        unsigned int len = 0;
+
+        while (len < TEXT_IO_BUFLEN && console->head + len != end &&
+               console->data[(console->head + len) & CONSOLE_MASK] != '\n') {
+            chunk[len] = console->data[(console->head + len) & CONSOLE_MASK];
+            len++;
+        }
+
+        // the line end is dropped, the device ends every flush with one
+        unsigned int consumed = len;
+
+        if (console->head + len != end && console->data[(console->head + len) & CONSOLE_MASK] == '\n')
+            consumed++;
+
+        dbgln(chunk, len);
+        console->head += consumed;
+    }
+}
+
+#else
+
+// without a textIO device the output is dropped
+static void console_drain(struct console_buffer* console, unsigned int end)
+{
+    console->head = end;
+}
+
+#endif
+
+void console_flush(struct process_control_block* pcb, int partial)
+{
+    struct console_buffer* console = console_buffer_of(pcb);
+    unsigned int end = console->tail;
+
+    // only write up to the last line end, unless the rest is wanted as well
+    if (!partial) {
+        while (end != console->head && console->data[(end - 1) & CONSOLE_MASK] != '\n')
+            end--;
+    }
+
+    console_drain(console, end);
+}
+
+void console_flush_all()
+{
+    for (int i = 0; i < PROCESS_COUNT; i++) {
+        if (console_buffers[i].head != console_buffers[i].tail)
+            console_flush(processes + i, 0);
+    }
+}
+
+int console_write(struct process_control_block* pcb, char* buf, size_t len)
+{
+    struct console_buffer* console = console_buffer_of(pcb);
+
+    while (len > 0) {
+        unsigned int space = CONSOLE_BUFFER_SIZE - (console->tail - console->head);
+
+        // a full buffer is written out, even if it ends in the middle of a line
+        if (space == 0) {
+            console_flush(pcb, 1);
+            continue;
+        }
+
+        // copy up to the end of the free space or the end of the buffer
+        unsigned int start = console->tail & CONSOLE_MASK;
+        unsigned int count = len < space ? len : space;
+
+        if (count > CONSOLE_BUFFER_SIZE - start)
+            count = CONSOLE_BUFFER_SIZE - start;
+
+        copy_bytes(&console->data[start], buf, count);
+        console->tail += count;
+        buf += count;
+        len -= count;
+    }
+
+    return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef H_CONSOLE
+#define H_CONSOLE
+
+#include "../kernel.h"
+#include "ktypes.h"
+
+// file descriptors accepted by ECALL_WRITE, both go to the console
+#define CONSOLE_STDOUT 1
+#define CONSOLE_STDERR 2
+
+// append len bytes of buf to the output buffer of pcb, the buffer is flushed
+// to the console when it fills up
+int console_write(struct process_control_block* pcb, char* buf, size_t len);
+
+// write the complete lines buffered for pcb to the console, or everything
+// if partial is set
+void console_flush(struct process_control_block* pcb, int partial);
+
+// write the complete lines of all processes, called before a hart goes idle
+void console_flush_all();
+
+#endif
@@ -7,16 +7,17 @@
 #error "You set TIMECMP_IN_MEMORY but did not provide a memory addres in TIMECMP_MEM_ADDR!"
 #endif
 
+// every hart has its own mtimecmp register, they are laid out next to each other
 void write_mtimecmp(uint64 mtimecmp)
 {
     uint32 lo = mtimecmp & 0xffffffff;
     uint32 hi = mtimecmp >> 32;
+    uint32 addr = TIMECMP_MEM_ADDR + 8 * hart_id();
 
     __asm__ volatile (
-          "li t0, %0\n"
-          "sw %1, 0(t0)\n"
-          "sw %2, 4(t0)" ::
-          "i"(TIMECMP_MEM_ADDR), "r"(lo), "r"(hi)
+          "sw %1, 0(%0)\n"
+          "sw %2, 4(%0)" ::
+          "r"(addr), "r"(lo), "r"(hi)
     );
 }
 
@@ -36,3 +37,33 @@ void write_mtimecmp(uint64 mtimecmp)
 }
 
 #endif
+
+#ifdef IPI_MEM_ADDR
+
+// the msip registers of all harts are 32 bit words starting at IPI_MEM_ADDR,
+// writing 1 raises a software interrupt on that hart
+void send_ipi(int hart)
+{
+    ((volatile uint32*) IPI_MEM_ADDR)[hart] = 1;
+}
+
+void clear_ipi()
+{
+    ((volatile uint32*) IPI_MEM_ADDR)[hart_id()] = 0;
+}
+
+#else
+
+// without msip registers idle harts poll for work instead
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+void send_ipi(int hart)
+{
+}
+#pragma GCC diagnostic pop
+
+void clear_ipi()
+{
+}
+
+#endif
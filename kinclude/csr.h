@@ -12,6 +12,7 @@
 #define CSR_MIP         0x344       // machine interrupt pending
 #define CSR_TIME        0xC01       // time csr
 #define CSR_TIMEH       0xC81       // high bits of time
+#define CSR_MHARTID     0xF14       // id of the executing hart
 
 #define CSR_MTIMECMP    0x780       // mtimecmp register for timer interrupts
 #define CSR_MTIMECMPH   0x781       // mtimecmph register for timer interrupts
@@ -26,6 +27,24 @@
 // do not define C macros and other C stuff when this is included inside assembly
 #ifndef __assembly
 
+void write_mtimecmp(uint64 mtimecmp);
+
+// inter-processor interrupts set the msip bit of another hart, this needs
+// the memory mapped msip registers of a clint
+#ifdef IPI_MEM_ADDR
+#define IPI_AVAILABLE 1
+#else
+#define IPI_AVAILABLE 0
+#endif
+
+void send_ipi(int hart);
+void clear_ipi();
+
+// the host build (see host/) simulates the harts and the timer instead
+#ifdef HOST_BUILD
+#include "../host/hal.h"
+#else
+
 #define CSR_READ(csr_id, result) { \
         __asm__ ("csrr %0, %1" : "=r"((result)) : "I"((csr_id))); \
 }
@@ -38,7 +57,18 @@
         __asm__ ("csrw %0, %1" :: "I"(CSR_HALT), "I"(code)); \
 }
 
-void write_mtimecmp(uint64 mtimecmp);
+// returns the id of the executing hart
+inline __attribute__((always_inline)) int hart_id()
+{
+#if HART_COUNT > 1
+    int id;
+
+    __asm__ volatile ("csrr %0, %1" : "=r"(id) : "i"(CSR_MHARTID));
+    return id;
+#else
+    return 0;
+#endif
+}
 
 inline __attribute__((always_inline)) uint64 read_time()
 {
@@ -53,6 +83,7 @@ inline __attribute__((always_inline)) uint64 read_time()
     return (uint64) higher << 32 | lower;
 }
 
+#endif
 #endif
 
 #endif
@@ -3,13 +3,18 @@
 #include "sched.h"
 #include "csr.h"
 #include "io.h"
+#include "futex.h"
+#include "chan.h"
+#include "ring.h"
+#include "malloc.h"
+#include "loader.h"
+#include "trace.h"
+#include "console.h"
+#include "pmp.h"
 
 // this type is only used here, therefore we don't need it in the ktypes header
 typedef optional_int (*ecall_handler)(int*, struct process_control_block*);
 
-ecall_handler ecall_table[ECALL_TABLE_LEN] = { 0 };
-
-
 // ignore unused parameter errors only for these functions
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wunused-parameter"
@@ -20,9 +25,13 @@ optional_int ecall_handle_spawn_thread(int* args_ptr, struct process_control_blo
     // args_ptr[0] is a0, args_ptr[1] is a1, etc.
     void* entry = (void*) args_ptr[0];  // a0
     void* args = (void*) args_ptr[1];   // a1
+    int stack_size = args_ptr[2];       // a2, 0 selects the default size
+
+    if (stack_size < 0)
+        return (optional_int) { .error = EINVAL };
 
     // create a new thread
-    optional_pcbptr pcb_or_err = create_new_thread(pcb, entry, args);
+    optional_pcbptr pcb_or_err = create_new_thread(pcb, entry, args, stack_size);
 
     // if an error occured, pass it along to the process
     if (has_error(pcb_or_err))
@@ -31,6 +40,19 @@ optional_int ecall_handle_spawn_thread(int* args_ptr, struct process_control_blo
     return (optional_int) { .value = pcb_or_err.value->pid };
 }
 
+optional_int ecall_handle_spawn_process(int* args, struct process_control_block* pcb)
+{
+    int binid = args[0];    // a0
+    int arg = args[1];      // a1, passed to the new process in a1
+
+    optional_pcbptr pcb_or_err = loader_spawn(binid, arg, pcb->pid);
+
+    if (has_error(pcb_or_err))
+        return (optional_int) { .error = pcb_or_err.error };
+
+    return (optional_int) { .value = pcb_or_err.value->pid };
+}
+
 optional_int ecall_handle_sleep(int* args, struct process_control_block* pcb)
 {
     // read len from a0
@@ -43,8 +65,8 @@ optional_int ecall_handle_sleep(int* args, struct process_control_block* pcb)
 
     // if a positive interval is given, calculate the wakeup time
     if (len > 0) {
-        pcb->asleep_until = read_time() + len;
         pcb->status = PROC_WAIT_SLEEP;
+        scheduler_set_timeout(pcb, read_time() + len);
     }
 
     return (optional_int) { .value = 0 };
@@ -64,9 +86,10 @@ optional_int ecall_handle_join(int* args, struct process_control_block* pcb)
     if (target->status == PROC_DEAD)
         return (optional_int) { .value = target->exit_code };
 
-    // mark the current process as waiting for the target process
+    // block the current process on the targets list of joiners, it is
+    // woken up with the exit code when the target is destroyed
     pcb->status = PROC_WAIT_PROC;
-    pcb->waiting_for_process = target;
+    wait_queue_add(&target->joiners, pcb);
 
     // check if a valid timeout was passed in register a1
     int timeout = args[1];
@@ -74,10 +97,10 @@ optional_int ecall_handle_join(int* args, struct process_control_block* pcb)
     if (timeout <= 0)
         return (optional_int) { .value = 0 };
 
-    // set the asleep_until field
+    // put the process into the timer queue
     unsigned int len = (unsigned int) timeout;
 
-    pcb->asleep_until = read_time() + len;
+    scheduler_set_timeout(pcb, read_time() + len);
 
     // here we can return whatever value we want, as it is overwritten when
     // the process is awoken again
@@ -94,15 +117,12 @@ optional_int ecall_handle_kill(int* args, struct process_control_block* pcb)
         return (optional_int) { .error = ESRCH };
 
     // return success if the process is dead
-    if (target == PROC_DEAD)
+    if (target->status == PROC_DEAD)
         return (optional_int) { .value = 1 };
 
-    // kill target by marking it dead
-    target->status = PROC_DEAD;
-    target->exit_code = -10;    // set unique exit code
-
-    // call process destructor
-    destroy_process(pcb);
+    // kill target by setting a unique exit code and calling the destructor
+    target->exit_code = -10;
+    destroy_process(target);
 
     // return success
     return (optional_int) { .value = 1 };
@@ -110,7 +130,6 @@ optional_int ecall_handle_kill(int* args, struct process_control_block* pcb)
 
 optional_int ecall_handle_exit(int* args, struct process_control_block* pcb)
 {
-    pcb->status = PROC_DEAD;
     pcb->exit_code = *args;
 
     // print a message if debugging is enabled
@@ -129,8 +148,215 @@ optional_int ecall_handle_exit(int* args, struct process_control_block* pcb)
     return (optional_int) { .value = 0 };
 }
 
+optional_int ecall_handle_set_sched(int* args, struct process_control_block* pcb)
+{
+    int pid = args[0];                          // a0, 0 selects the caller
+    enum sched_class sched_class = args[1];     // a1
+    int param = args[2];                        // a2, priority or weight
+
+    struct process_control_block* target = pid == 0 ? pcb : process_from_pid(pid);
+
+    if (target == NULL || target->status == PROC_DEAD)
+        return (optional_int) { .error = ESRCH };
+
+    int error = scheduler_set_class(target, sched_class, param);
+
+    return (optional_int) { .error = error };
+}
+
+optional_int ecall_handle_set_affinity(int* args, struct process_control_block* pcb)
+{
+    int pid = args[0];                      // a0, 0 selects the caller
+    unsigned int mask = args[1];            // a1, bit i allows hart i
+
+    struct process_control_block* target = pid == 0 ? pcb : process_from_pid(pid);
+
+    if (target == NULL || target->status == PROC_DEAD)
+        return (optional_int) { .error = ESRCH };
+
+    return (optional_int) { .error = scheduler_set_affinity(target, mask) };
+}
+
+optional_int ecall_handle_getstats(int* args, struct process_control_block* pcb)
+{
+    int pid = args[0];                                          // a0, 0 selects the caller
+    struct sched_stats* stats = (struct sched_stats*) args[1];  // a1
+
+    struct process_control_block* target = pid == 0 ? pcb : process_from_pid(pid);
+
+    if (target == NULL)
+        return (optional_int) { .error = ESRCH };
+
+    // the kernel writes the counters, so the buffer has to be memory of the caller
+    if (((uint32) stats & 3) != 0 || !pmp_user_range(pcb, stats, sizeof(struct sched_stats)))
+        return (optional_int) { .error = EINVAL };
+
+    scheduler_get_stats(target, stats);
+
+    return (optional_int) { .value = 0 };
+}
+
+optional_int ecall_handle_write(int* args, struct process_control_block* pcb)
+{
+    int fd = args[0];               // a0
+    char* buf = (char*) args[1];    // a1
+    int len = args[2];              // a2
+
+    if (fd != CONSOLE_STDOUT && fd != CONSOLE_STDERR)
+        return (optional_int) { .error = EINVAL };
+
+    // the buffer is copied by the kernel, so it has to be memory of the caller
+    if (len < 0 || (len > 0 && !pmp_user_range(pcb, buf, len)))
+        return (optional_int) { .error = EINVAL };
+
+    return (optional_int) { .error = console_write(pcb, buf, len), .value = len };
+}
+
+optional_int ecall_handle_futex_wait(int* args, struct process_control_block* pcb)
+{
+    int* addr = (int*) args[0];     // a0
+    int expected = args[1];         // a1
+    int timeout = args[2];          // a2, 0 waits forever
+
+    // the value returned here is overwritten with ETIMEOUT if the timeout
+    // runs out before the process is woken
+    return (optional_int) { .error = futex_wait(pcb, addr, expected, timeout) };
+}
+
+optional_int ecall_handle_futex_wake(int* args, struct process_control_block* pcb)
+{
+    int* addr = (int*) args[0];     // a0
+    int count = args[1];            // a1
+
+    return (optional_int) { .value = futex_wake(pcb, addr, count) };
+}
+
+optional_int ecall_handle_chan_create(int* args, struct process_control_block* pcb)
+{
+    int capacity = args[0];         // a0, 0 creates an unbuffered channel
+
+    return chan_create(pcb, capacity);
+}
+
+optional_int ecall_handle_chan_send(int* args, struct process_control_block* pcb)
+{
+    int id = args[0];               // a0
+    struct chan_message msg = {
+        .data   = args[1],          // a1
+        .buf    = (void*) args[2],  // a2
+        .len    = args[3],          // a3
+    };
+    int timeout = args[4];          // a4, 0 waits forever
+
+    return (optional_int) { .error = chan_send(pcb, id, &msg, timeout) };
+}
+
+optional_int ecall_handle_chan_recv(int* args, struct process_control_block* pcb)
+{
+    int id = args[0];               // a0
+    int timeout = args[1];          // a1, 0 waits forever
+    struct chan_message msg = { 0 };
+
+    int error = chan_recv(pcb, id, &msg, timeout);
+
+    // the buffer is returned in a2 and a3, the data word as the value
+    args[2] = (int) msg.buf;
+    args[3] = (int) msg.len;
+
+    return (optional_int) { .error = error, .value = msg.data };
+}
+
+optional_int ecall_handle_chan_close(int* args, struct process_control_block* pcb)
+{
+    int id = args[0];               // a0
+
+    return (optional_int) { .error = chan_close(pcb, id) };
+}
+
+optional_int ecall_handle_ring_setup(int* args, struct process_control_block* pcb)
+{
+    struct ring_header* ring = (struct ring_header*) args[0];   // a0, NULL unregisters
+    int entries = args[1];                                      // a1
+
+    return (optional_int) { .error = ring_setup(pcb, ring, entries) };
+}
+
+optional_int ecall_handle_ring_enter(int* args, struct process_control_block* pcb)
+{
+    return ring_enter(pcb);
+}
+
+optional_int ecall_handle_sbrk(int* args, struct process_control_block* pcb)
+{
+    int increment = args[0];    // a0
+
+    optional_voidptr brk_or_err = malloc_sbrk(pcb, increment);
+
+    return (optional_int) { .error = brk_or_err.error, .value = (int) brk_or_err.value };
+}
+
+optional_int ecall_handle_mmap(int* args, struct process_control_block* pcb)
+{
+    size_t len = args[0];       // a0
+
+    optional_voidptr region_or_err = malloc_region(pcb, len);
+
+    return (optional_int) { .error = region_or_err.error, .value = (int) region_or_err.value };
+}
+
+optional_int ecall_handle_munmap(int* args, struct process_control_block* pcb)
+{
+    void* start = (void*) args[0];  // a0
+
+    return (optional_int) { .error = free_region(pcb, start) };
+}
+
 #pragma GCC diagnostic pop
 
+// associates ecall codes with their handlers, the table has an entry for
+// every code in enum ecall_codes, unused codes are NULL
+static const ecall_handler ecall_table[ECALL_COUNT] = {
+    [ECALL_SPAWN]       = ecall_handle_spawn_thread,
+    [ECALL_SLEEP]       = ecall_handle_sleep,
+    [ECALL_JOIN]        = ecall_handle_join,
+    [ECALL_KILL]        = ecall_handle_kill,
+    [ECALL_EXIT]        = ecall_handle_exit,
+    [ECALL_SET_SCHED]   = ecall_handle_set_sched,
+    [ECALL_FUTEX_WAIT]  = ecall_handle_futex_wait,
+    [ECALL_FUTEX_WAKE]  = ecall_handle_futex_wake,
+    [ECALL_CHAN_CREATE] = ecall_handle_chan_create,
+    [ECALL_CHAN_SEND]   = ecall_handle_chan_send,
+    [ECALL_CHAN_RECV]   = ecall_handle_chan_recv,
+    [ECALL_CHAN_CLOSE]  = ecall_handle_chan_close,
+    [ECALL_RING_SETUP]  = ecall_handle_ring_setup,
+    [ECALL_RING_ENTER]  = ecall_handle_ring_enter,
+    [ECALL_SBRK]        = ecall_handle_sbrk,
+    [ECALL_MMAP]        = ecall_handle_mmap,
+    [ECALL_MUNMAP]      = ecall_handle_munmap,
+    [ECALL_SET_AFFINITY] = ecall_handle_set_affinity,
+    [ECALL_SPAWN_PROCESS] = ecall_handle_spawn_process,
+    [ECALL_GETSTATS]    = ecall_handle_getstats,
+    [ECALL_WRITE]       = ecall_handle_write,
+};
+
+// run the handler for an ecall code, args points to the a0 register
+optional_int ecall_dispatch(int code, int* args, struct process_control_block* pcb)
+{
+    // negative codes become large when cast to unsigned, so one comparison
+    // checks both bounds
+    pcb->stats.ecalls++;
+    trace(TRACE_ECALL_ENTER, pcb->pid, code, args[0]);
+
+    optional_int result = { .error = ENOCODE };
+
+    if ((unsigned int) code < ECALL_COUNT && ecall_table[code] != NULL)
+        result = ecall_table[code](args, pcb);
+
+    trace(TRACE_ECALL_EXIT, pcb->pid, result.error, result.value);
+
+    return result;
+}
+
 void trap_handle_ecall()
 {
     // save current clock so we don't waste too much process time
@@ -140,16 +366,12 @@ void trap_handle_ecall()
     int *regs = pcb->regs;
     int code = regs[REG_A0 + 7];    // syscall code is stored inside a7
 
-    // check if the code is too large/small or if the handler is zero
-    if (code < 0 || code > ECALL_TABLE_LEN || ecall_table[code] == NULL) {
-        regs[REG_A0] = ENOCODE;
-    } else {
-        // run the corresponding ecall handler
-        optional_int handler_result = ecall_table[code](&regs[REG_A0], pcb);
-        // populate registers with return value and error
-        regs[REG_A0] = handler_result.error;
-        regs[REG_A0 + 1] = handler_result.value;
-    }
+    // run the corresponding ecall handler
+    optional_int handler_result = ecall_dispatch(code, &regs[REG_A0], pcb);
+
+    // populate registers with return value and error
+    regs[REG_A0] = handler_result.error;
+    regs[REG_A0 + 1] = handler_result.value;
 
     // increment pc of this process to move past ecall instruction
     pcb->pc += 4;
@@ -158,60 +380,69 @@ void trap_handle_ecall()
     scheduler_try_return_to(pcb);
 }
 
-void trap_handle(int interrupt_bit, int code, int mtval)
-{
-    if (interrupt_bit) {
-        switch (code) {
-        // timer interrupts
-        case 4:
-        case 5:
-        case 6:
-        case 7:
-            scheduler_run_next();
-            break;
-        default:
-            // any other interrupt is not supported currently
-            HALT(12);
-            break;
-        }
-    } else {
-        switch (code) {
-        // any known exception code:
-        case 0:
-        case 1:
-        case 2:
-        case 4:
-        case 5:
-        case 6:
-        case 7:
-        case 12:
-        case 13:
-        case 15:
-            handle_exception(code, mtval);
-            break;
-        // user or supervisor ecall
-        case 8:
-        case 9:
-            trap_handle_ecall();
-            break;
-        // unknown code
-        default:
-            HALT(13);
-        }
+// ecalls from user mode enter here with only the caller saved registers
+// stored in the pcb. The return value tells boot.S whether the process can be
+// resumed right away (0), or if the scheduler has to run (1). The kernel lock
+// is still held in the second case.
+int trap_handle_ecall_fast()
+{
+    kernel_enter();
+    mark_ecall_entry();
+
+    struct process_control_block* pcb = get_current_process();
+    int *regs = pcb->regs;
+    int code = regs[REG_A0 + 7];    // syscall code is stored inside a7
+
+    optional_int handler_result = ecall_dispatch(code, &regs[REG_A0], pcb);
+
+    regs[REG_A0] = handler_result.error;
+    regs[REG_A0 + 1] = handler_result.value;
+    pcb->pc += 4;
+
+    return !scheduler_can_return(pcb);
+}
+
+// exceptions enter here through the first entry of the trap vector table,
+// user ecalls are handled by trap_handle_ecall_fast before reaching this
+void trap_handle_exception(int code, int mtval)
+{
+    kernel_enter();
+
+    switch (code) {
+    // any known exception code:
+    case 0:
+    case 1:
+    case 2:
+    case 4:
+    case 5:
+    case 6:
+    case 7:
+    case 12:
+    case 13:
+    case 15:
+        handle_exception(code, mtval);
+        break;
+    // supervisor ecall
+    case 9:
+        trap_handle_ecall();
+        break;
+    // unknown code
+    default:
+        HALT(13);
     }
     HALT(14);
     __builtin_unreachable();
 }
 
-// this writes the function pointers to the ecall table
-// it's called from the kernels init() function
-void init_ecall_table()
+// interrupts without a handler of their own end up here
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+void trap_handle_interrupt(int code)
 {
-    ecall_table[ECALL_SPAWN] = ecall_handle_spawn_thread;
-    ecall_table[ECALL_SLEEP] = ecall_handle_sleep;
-    ecall_table[ECALL_JOIN] = ecall_handle_join;
-    ecall_table[ECALL_KILL] = ecall_handle_kill;
-    ecall_table[ECALL_EXIT] = ecall_handle_exit;
+    kernel_lock_acquire();
+    // any other interrupt is not supported currently
+    HALT(12);
+    __builtin_unreachable();
 }
 
 // this exception handler is crude and just kills off any process who
@@ -221,10 +452,10 @@ void handle_exception(int ecode, int mtval)
     // kill off offending process
     struct process_control_block* pcb = get_current_process();
 
-    pcb->status = PROC_DEAD;
     pcb->exit_code = -99;
     destroy_process(pcb);
 
     // run the next process
     scheduler_run_next();
 }
+#pragma GCC diagnostic pop
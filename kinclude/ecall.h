@@ -12,17 +12,35 @@ enum ecall_codes {
     ECALL_JOIN  = 3,
     ECALL_KILL  = 4,
     ECALL_EXIT  = 5,
+    ECALL_SET_SCHED = 6,
+    ECALL_FUTEX_WAIT = 7,
+    ECALL_FUTEX_WAKE = 8,
+    ECALL_CHAN_CREATE = 9,
+    ECALL_CHAN_SEND = 10,
+    ECALL_CHAN_RECV = 11,
+    ECALL_CHAN_CLOSE = 12,
+    ECALL_RING_SETUP = 13,
+    ECALL_RING_ENTER = 14,
+    ECALL_SBRK  = 15,
+    ECALL_MMAP  = 16,
+    ECALL_MUNMAP = 17,
+    ECALL_SET_AFFINITY = 18,
+    ECALL_SPAWN_PROCESS = 19,
+    ECALL_GETSTATS = 20,
+    ECALL_WRITE = 21,
+    // number of ecall codes, keep this last
+    ECALL_COUNT
 };
 
-#define ECALL_TABLE_LEN 8
-
-// initializer for ecall lookup table
-void init_ecall_table();
+// run the handler for an ecall code
+optional_int ecall_dispatch(int code, int* args, struct process_control_block* pcb);
 
 // exception handler
 void handle_exception(int ecode, int mtval);
 
-// called by the assembly trap handler in boot.S
-void __attribute__((__noreturn__)) trap_handle(int interrupt_bit, int code, int mtval);
+// called by the assembly trap vector in boot.S
+void __attribute__((__noreturn__)) trap_handle_exception(int code, int mtval);
+void __attribute__((__noreturn__)) trap_handle_interrupt(int code);
+int trap_handle_ecall_fast();
 
 #endif
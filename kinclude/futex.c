@@ -0,0 +1,70 @@
+#include "../kernel.h"
+#include "ktypes.h"
+#include "futex.h"
+#include "sched.h"
+#include "csr.h"
+#include "pmp.h"
+
+// processes waiting on a futex are kept in a wait queue selected by hashing
+// the futex address. Different addresses can share a bucket, so the address
+// of each waiter is stored in its pcb.
+static struct wait_queue futex_table[FUTEX_HASH_SIZE];
+
+static inline struct wait_queue* futex_bucket(int* addr)
+{
+    uint32 key = ((uint32) addr) >> 2;
+
+    key ^= key >> 8;
+    return &futex_table[key & (FUTEX_HASH_SIZE - 1)];
+}
+
+// futex words must be aligned and in the memory of the process, the kernel
+// reads them on its behalf
+static inline int futex_addr_valid(struct process_control_block* pcb, int* addr)
+{
+    return ((uint32) addr & 3) == 0 && pmp_user_range(pcb, addr, sizeof(int));
+}
+
+int futex_wait(struct process_control_block* pcb, int* addr, int expected, int timeout)
+{
+    if (!futex_addr_valid(pcb, addr) || timeout < 0)
+        return EINVAL;
+
+    // if the value already changed, the waker ran before us
+    if (*((volatile int*) addr) != expected)
+        return EAGAIN;
+
+    pcb->status = PROC_WAIT_FUTEX;
+    pcb->futex_addr = addr;
+    wait_queue_add(futex_bucket(addr), pcb);
+
+    // a timeout of zero waits forever
+    if (timeout > 0)
+        scheduler_set_timeout(pcb, read_time() + (unsigned int) timeout);
+
+    return 0;
+}
+
+int futex_wake(struct process_control_block* pcb, int* addr, int count)
+{
+    if (!futex_addr_valid(pcb, addr))
+        return 0;
+
+    struct process_control_block* waiter = futex_bucket(addr)->head;
+    int woken = 0;
+
+    while (waiter != NULL && woken < count) {
+        // waking unlinks the process, so remember the next one first
+        struct process_control_block* next = waiter->wait_next;
+
+        if (waiter->futex_addr == addr) {
+            waiter->futex_addr = NULL;
+            scheduler_wake(waiter);
+            woken++;
+        }
+
+        waiter = next;
+    }
+
+    return woken;
+}
@@ -0,0 +1,15 @@
+#ifndef H_FUTEX
+#define H_FUTEX
+
+#include "../kernel.h"
+#include "ktypes.h"
+
+// block pcb until another process wakes addr, if *addr still equals expected.
+// addr has to be in the memory of pcb.
+int futex_wait(struct process_control_block* pcb, int* addr, int expected, int timeout);
+
+// wake up to count processes waiting on addr, returns the number woken. addr
+// has to be in the memory of pcb, the process waking them.
+int futex_wake(struct process_control_block* pcb, int* addr, int count);
+
+#endif
@@ -1,3 +1,4 @@
+#include "ktypes.h"
 #include "io.h"
 // this file should only be used for debugging purposes. Most functions here
 // could easily corrupt kernel memory if used with untrusted input.
@@ -7,32 +8,46 @@
 
 // this function writes a string to the TEXT_IO buffer
 // it adds a newline at the end and splits the passed string into smaller chunks
-// if it is larger than TEXT_IO_BUFLEN.
+// if it is larger than TEXT_IO_BUFLEN. The buffer is written a word at a time,
+// the string ends at the first zero byte.
 void dbgln(char* text, int len)
 {
-    // if the passed text is longer than TEXT_IO_BUFLEN, print it in chunks
-    while (len > TEXT_IO_BUFLEN) {
-        dbgln(text, TEXT_IO_BUFLEN);
-        text += TEXT_IO_BUFLEN;
-        len -= TEXT_IO_BUFLEN;
-    }
+    // this is the address of the textIO buffer
+    volatile uint32* ioaddr = (volatile uint32*) (TEXT_IO_ADDR + 4);
 
-    // this is the address of the textIO
-    char* ioaddr = (char*) TEXT_IO_ADDR + 4;
+    do {
+        int chunk = len < TEXT_IO_BUFLEN ? len : TEXT_IO_BUFLEN;
+        int end = 0;
 
-    // write message bytewise to buffer (this could be implemented faster)
-    for (int i = 0; i < len; i++) {
-        if (*text == 0)
-            break;
-        *ioaddr++ = *text++;
-    }
+        while (end < chunk && text[end] != 0)
+            end++;
+
+        // pack the chunk into words, a shorter chunk is followed by a newline
+        // and zero bytes up to the end of the word
+        for (int i = 0; i < end || (i == end && end < TEXT_IO_BUFLEN); i += 4) {
+            uint32 word = 0;
 
-    // add a newline
-    if (len < TEXT_IO_BUFLEN)
-        *ioaddr = '\n';
+            for (int j = 3; j >= 0; j--) {
+                word <<= 8;
+                if (i + j < end)
+                    word |= (byte) text[i + j];
+                else if (i + j == end)
+                    word |= '\n';
+            }
+
+            ioaddr[i / 4] = word;
+        }
+
+        // write a 1 to the start of the textIO to signal a buffer flush
+        *((volatile char*) TEXT_IO_ADDR) = 1;
+
+        // the string ended early
+        if (end < chunk)
+            break;
 
-    // write a 1 to the start of the textIO to signal a buffer flush
-    *((char*) TEXT_IO_ADDR) = 1;
+        text += chunk;
+        len -= chunk;
+    } while (len > 0);
 }
 
 
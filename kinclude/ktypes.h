@@ -1,8 +1,13 @@
 #ifndef H_ktypes
 #define H_ktypes
 
-// define the nullpointer
+// define the nullpointer, the host build shares it and size_t with the c
+// library
+#ifdef HOST_BUILD
+#include <stddef.h>
+#else
 #define NULL ((void*) 0)
+#endif
 
 // types with explicit bit-widths
 typedef unsigned int uint32;
@@ -19,7 +24,9 @@ enum error_code {
     ENOMEM  = 3,    // not enough memory
     ENOBUFS = 4,    // no space left in buffer
     ESRCH   = 5,    // no such process
-    ETIMEOUT= 6     // timeout while waiting
+    ETIMEOUT= 6,    // timeout while waiting
+    EAGAIN  = 7,    // value changed, try again
+    EPIPE   = 8     // channel is closed
 };
 
 /*
@@ -31,11 +38,103 @@ enum process_status {
     PROC_RDY        = 1,
     PROC_WAIT_PROC  = 2,
     PROC_WAIT_SLEEP = 3,
+    PROC_WAIT_FUTEX = 4,
+    PROC_WAIT_CHAN  = 5,
+};
+
+enum sched_class {
+    SCHED_FAIR  = 0,    // weighted round robin, the slice length scales with the weight
+    SCHED_FIFO  = 1,    // real-time, runs until it blocks or a higher priority wakes up
+};
+
+// a message sent over a channel. buf points to a buffer whose ownership is
+// handed from the sender to the receiver, the data is never copied.
+struct chan_message {
+    int data;
+    void* buf;
+    unsigned int len;
+    int owner;                      // pid owning the region at buf, or 0
+    int sender;                     // pid of the sending process
+};
+
+/*
+ * Ecall rings
+ *
+ * a process can register a pair of rings in its own memory to submit many
+ * ecalls with a single trap. The layout is shared with user space: the header
+ * is followed by the submission queue entries and then the completion queue
+ * entries, both arrays have the same (power of two) length.
+ */
+
+// a submitted ecall, opcode is the ecall code
+struct ring_sqe {
+    int opcode;
+    int args[4];
+    int user_data;
+};
+
+// the result of a submitted ecall, holds a0 to a3 after the ecall finished
+struct ring_cqe {
+    int user_data;
+    int error;
+    int value;
+    int extra[2];
+};
+
+struct ring_header {
+    volatile unsigned int sq_head;  // advanced by the kernel
+    volatile unsigned int sq_tail;  // advanced by user space
+    volatile unsigned int cq_head;  // advanced by user space
+    volatile unsigned int cq_tail;  // advanced by the kernel
+};
+
+/*
+ * Scheduler statistics
+ *
+ * every process counts where its time went, times are in mtime ticks. The
+ * layout is shared with user space, ECALL_GETSTATS copies a struct
+ * sched_stats out.
+ */
+
+struct proc_stats {
+    uint64 user_time;               // running in user mode
+    uint64 kernel_time;             // in trap handlers on behalf of the process
+    uint64 wait_time;               // runnable, but waiting in a ready queue
+    unsigned int voluntary_switches;    // gave up the hart by blocking
+    unsigned int involuntary_switches;  // preempted by another process
+    unsigned int ecalls;            // ecalls issued, including ring submissions
+};
+
+struct sched_stats {
+    struct proc_stats proc;
+    uint64 idle_time;               // time all harts spent idling
+    uint64 now;                     // mtime when the stats were taken
 };
 
 // forward define structs for recursive references
 struct process_control_block;
 struct loaded_binary;
+struct mem_region;
+
+// affinity mask that allows a process to run on every hart
+#define AFFINITY_ALL_HARTS (~0u >> (32 - HART_COUNT))
+
+// the pmp registers of a process, they are rebuilt when version differs
+// from the mem_version of the process owning its memory
+#define PMP_ENTRY_COUNT 16
+
+struct pmp_image {
+    uint32 cfg[PMP_ENTRY_COUNT / 4];
+    uint32 addr[PMP_ENTRY_COUNT];
+    unsigned int version;
+};
+
+// a wait queue is a FIFO list of blocked processes, linked through the
+// wait_next field of their pcbs
+struct wait_queue {
+    struct process_control_block* head;
+    struct process_control_block* tail;
+};
 
 struct process_control_block {
     int pid;
@@ -45,13 +144,55 @@ struct process_control_block {
     int exit_code;
     // scheduling information
     enum process_status status;
-    struct process_control_block* waiting_for_process;
+    // set while a dead process still holds its memory, it is released once no
+    // hart executes the process or one of its threads anymore
+    int dying;
+    // number of dying processes started by this one, they are released first
+    int dying_children;
     unsigned long long int asleep_until;
+    // the wait queue this process is blocked on, and its link inside of it
+    struct wait_queue* waiting_on;
+    struct process_control_block* wait_next;
+    // processes blocked in a join on this process
+    struct wait_queue joiners;
+    // address of the futex word this process is waiting on
+    int* futex_addr;
+    // message of a sender blocked on a full channel
+    struct chan_message chan_msg;
+    // registered ecall ring, and the state of the batch being processed
+    struct ring_header* ring;
+    int ring_entries;
+    int ring_busy;
+    int ring_completed;
+    // the hart this process runs on, or whose ready queue it is in
+    int hart;
+    // bit i is set if the process may run on hart i
+    unsigned int affinity;
+    // ready queue links, only set while the process is in the ready queue
+    struct process_control_block* rq_prev;
+    struct process_control_block* rq_next;
+    // 1-based position in the timer queue, 0 if the process has no timeout
+    int timer_slot;
+    // scheduling class, real-time priority and fair-share weight
+    enum sched_class sched_class;
+    int priority;
+    int weight;
+    // accounting, stats_mark is the time the current interval started
+    struct proc_stats stats;
+    uint64 stats_mark;
     // hierarchical information
     struct loaded_binary* binary;
     struct process_control_block* parent;
     // memory management information
     void* stack_top;
+    unsigned int stack_size;
+    // memory regions owned by this process and its sbrk heap
+    struct mem_region* regions;
+    struct mem_region* heap;
+    unsigned int heap_brk;
+    // incremented whenever the regions change, and the cached pmp registers
+    unsigned int mem_version;
+    struct pmp_image pmp;
 };
 
 enum pcb_struct_registers {
@@ -71,10 +212,10 @@ enum pcb_struct_registers {
 };
 
 
-/* This struct holds information about binaries which are currently loaded into
- * memory. Currently the kernel is not able to load binaries into memory, as
- * no file system layer is implemented. When the memory image is built, the
- * list of loaded binaries is populated aswell.
+/* This struct describes a binary instance which is loaded into memory. The
+ * kernel is not able to load binaries from storage, as no file system layer is
+ * implemented. Instead, package.py describes the binaries in the memory image
+ * (see loader.h) and every instance is built from that description.
  */
 typedef struct loaded_binary {
     int binid;
@@ -108,7 +249,9 @@ typedef struct loaded_binary {
 typedef void* voidptr;
 typedef struct process_control_block* pcbptr;
 // size_t is another standard type
+#ifndef HOST_BUILD
 typedef unsigned int size_t;
+#endif
 
 // create optionals for required types
 CreateOptionalOfType(int);
@@ -0,0 +1,316 @@
+#include "../kernel.h"
+#include "ktypes.h"
+#include "loader.h"
+#include "sched.h"
+#include "malloc.h"
+#include "io.h"
+#include "lz4.h"
+#include "blkdev.h"
+
+// Binaries are not stored in the image the way they are laid out in memory.
+// package.py writes the initialized parts of a binary as segments, and only
+// describes the zero filled parts (.bss, .sbss, .stack and the padding
+// between sections). Every instance is built in a block from the allocator:
+// its segments are copied or zeroed, then its relocations are applied.
+//
+// Every instance gets its own copy of all segments, read-only ones included.
+// Without an MMU the text can't be shared: the code reaches its data
+// pc-relative, so text and data have to stay at the same distance in one
+// block, and relocations can patch read-only data (jump tables) per instance.
+//
+// User binaries are compiled with -mcmodel=medany, so the code loads
+// addresses pc-relative and runs anywhere. Only absolute addresses stored in
+// data (pointer tables, jump tables, .init_array) depend on the position,
+// package.py lists them in the relocation table of the binary.
+
+// When the image is compressed, all segments are stored as one lz4 block after
+// the segment tables. The tables already point to where the segments end up,
+// loader_unpack_image expands them there before the first instance is built.
+
+// Binaries on the boot disk are only listed in the binary table at boot. When
+// one is started and isn't in memory, its record is read into a block from
+// the allocator and its segment and relocation tables are pointed there. The
+// record is freed again once the last instance of the binary exits.
+
+struct binary_state {
+    uint32 flags;
+    // where the record is on the disk, length is 0 for binaries in the image
+    uint32 block;
+    uint32 length;
+    // the record while it is in memory, NULL otherwise
+    void* record;
+    // number of running instances
+    int users;
+};
+
+static struct binary_state binary_states[PACKAGED_BINARY_COUNT];
+
+// descriptors of running instances, a process can only have one image, so we
+// never need more than PROCESS_COUNT. Unused descriptors have a binid of 0.
+static loaded_binary instances[PROCESS_COUNT];
+
+static struct packaged_binary* find_binary(int binid)
+{
+    for (int i = 0; i < PACKAGED_BINARY_COUNT; i++) {
+        if (binary_table[i].binid == 0)
+            break;
+        if (binary_table[i].binid == binid)
+            return binary_table + i;
+    }
+    return NULL;
+}
+
+static inline struct binary_state* state_of(struct packaged_binary* bin)
+{
+    return binary_states + (bin - binary_table);
+}
+
+static void load_segment(byte* base, struct image_segment* seg)
+{
+    uint32* to = (uint32*) (base + seg->offset);
+    uint32* from = seg->source;
+    uint32 words = seg->length / 4;
+
+    if (from == NULL) {
+        for (uint32 i = 0; i < words; i++)
+            to[i] = 0;
+    } else {
+        for (uint32 i = 0; i < words; i++)
+            to[i] = from[i];
+    }
+}
+
+static void relocate(byte* base, struct packaged_binary* bin)
+{
+    uint32 delta = (uint32) base - bin->link_base;
+
+    for (uint32 i = 0; i < bin->reloc_count; i++)
+        *(uint32*) (base + bin->relocs[i]) += delta;
+}
+
+// read blocks from the boot disk into a block from the allocator
+static optional_voidptr read_blocks(uint32 block, uint32 count)
+{
+    optional_voidptr buf_or_err = malloc_block(count * BLOCK_SIZE);
+
+    if (has_error(buf_or_err))
+        return buf_or_err;
+
+    optional_int res = boot_device->read(boot_device, block, count, buf_or_err.value);
+
+    if (has_error(res)) {
+        free_block(buf_or_err.value);
+        return (optional_voidptr) { .error = res.error };
+    }
+
+    return buf_or_err;
+}
+
+// read the record of a binary from the boot disk
+static int load_record(struct packaged_binary* bin, struct binary_state* state)
+{
+    optional_voidptr record_or_err = read_blocks(state->block, (state->length + BLOCK_SIZE - 1) / BLOCK_SIZE);
+
+    if (has_error(record_or_err))
+        return 0;
+
+    byte* record = record_or_err.value;
+
+    bin->segments = (struct image_segment*) record;
+    bin->relocs = (uint32*) (record + bin->segment_count * sizeof(struct image_segment));
+
+    for (uint32 i = 0; i < bin->segment_count; i++) {
+        if (bin->segments[i].source != NULL)
+            bin->segments[i].source = record + (uint32) bin->segments[i].source;
+    }
+
+    state->record = record;
+    return 1;
+}
+
+// free the record of a binary that is no longer used
+static void evict_record(struct packaged_binary* bin, struct binary_state* state)
+{
+    if (state->record == NULL || state->users > 0)
+        return;
+
+    free_block(state->record);
+    state->record = NULL;
+    bin->segments = NULL;
+    bin->relocs = NULL;
+}
+
+// build a new instance of bin in memory from the allocator
+static loaded_binary* create_instance(struct packaged_binary* bin)
+{
+    loaded_binary* instance = NULL;
+
+    for (int i = 0; i < PROCESS_COUNT; i++) {
+        if (instances[i].binid == 0) {
+            instance = instances + i;
+            break;
+        }
+    }
+
+    if (instance == NULL)
+        return NULL;
+
+    struct binary_state* state = state_of(bin);
+
+    if (state->length != 0 && state->record == NULL && !load_record(bin, state))
+        return NULL;
+
+    optional_voidptr image_or_err = malloc_block(bin->size);
+
+    if (has_error(image_or_err)) {
+        evict_record(bin, state);
+        return NULL;
+    }
+
+    byte* start = image_or_err.value;
+
+    for (uint32 i = 0; i < bin->segment_count; i++)
+        load_segment(start, bin->segments + i);
+
+    relocate(start, bin);
+
+    instance->binid = bin->binid;
+    instance->entrypoint = (int) (start + bin->entrypoint);
+    instance->bounds[0] = start;
+    instance->bounds[1] = start + bin->size;
+
+    state->users++;
+
+    return instance;
+}
+
+void loader_unpack_image()
+{
+    if (packed_image.source == NULL)
+        return;
+
+    optional_int res = lz4_decompress(packed_image.dest, packed_image.size, packed_image.source, packed_image.length);
+
+    if (has_error(res) || (uint32) res.value != packed_image.size)
+        dbgln("Error while unpacking image!", 28);
+}
+
+void loader_read_directory()
+{
+    if (boot_device == NULL)
+        return;
+
+    optional_voidptr buf_or_err = read_blocks(0, 1);
+
+    if (has_error(buf_or_err)) {
+        dbgln("Error while reading disk directory!", 35);
+        return;
+    }
+
+    struct disk_header* header = buf_or_err.value;
+
+    if (header->magic != DISK_MAGIC || header->version != DISK_VERSION) {
+        dbgln("No binaries on the disk", 23);
+        free_block(header);
+        return;
+    }
+
+    // the entries may span more than the first block
+    if (header->dir_blocks > 1) {
+        uint32 dir_blocks = header->dir_blocks;
+
+        free_block(header);
+        buf_or_err = read_blocks(0, dir_blocks);
+
+        if (has_error(buf_or_err)) {
+            dbgln("Error while reading disk directory!", 35);
+            return;
+        }
+
+        header = buf_or_err.value;
+    }
+
+    struct disk_entry* entries = (struct disk_entry*) (header + 1);
+    int slot = 0;
+
+    // binaries in the image come first
+    while (slot < PACKAGED_BINARY_COUNT && binary_table[slot].binid != 0)
+        slot++;
+
+    for (uint32 i = 0; i < header->count; i++, slot++) {
+        if (slot == PACKAGED_BINARY_COUNT) {
+            dbgln("Too many binaries on the disk", 29);
+            break;
+        }
+
+        struct disk_entry* entry = entries + i;
+
+        binary_table[slot] = (struct packaged_binary) {
+            .binid = entry->binid,
+            .entrypoint = entry->entrypoint,
+            .size = entry->size,
+            .link_base = entry->link_base,
+            .segment_count = entry->segment_count,
+            .reloc_count = entry->reloc_count,
+        };
+        binary_states[slot] = (struct binary_state) {
+            .flags = entry->flags,
+            .block = entry->block,
+            .length = entry->length,
+        };
+    }
+
+    free_block(header);
+}
+
+int loader_autostart(int binid)
+{
+    struct packaged_binary* bin = find_binary(binid);
+
+    if (bin == NULL)
+        return 0;
+
+    struct binary_state* state = state_of(bin);
+
+    // binaries in the image are always started
+    return state->length == 0 || (state->flags & DISK_AUTOSTART) != 0;
+}
+
+optional_pcbptr loader_spawn(int binid, int arg, int spawner)
+{
+    struct packaged_binary* bin = find_binary(binid);
+
+    if (bin == NULL)
+        return (optional_pcbptr) { .error = EINVAL };
+
+    loaded_binary* image = create_instance(bin);
+
+    if (image == NULL) {
+        dbgln("Error while loading binary", 26);
+        return (optional_pcbptr) { .error = ENOMEM };
+    }
+
+    optional_pcbptr pcb_or_err = create_new_process(image, spawner);
+
+    if (has_error(pcb_or_err)) {
+        loader_release(image);
+        return pcb_or_err;
+    }
+
+    pcb_or_err.value->regs[REG_A0 + 1] = arg;
+
+    return pcb_or_err;
+}
+
+void loader_release(loaded_binary* bin)
+{
+    struct packaged_binary* packaged = find_binary(bin->binid);
+
+    free_block(bin->bounds[0]);
+    bin->binid = 0;
+
+    if (packaged != NULL) {
+        state_of(packaged)->users--;
+        evict_record(packaged, state_of(packaged));
+    }
+}
@@ -0,0 +1,99 @@
+#ifndef H_LOADER
+#define H_LOADER
+
+#include "../kernel.h"
+#include "ktypes.h"
+
+// a part of the memory of a binary instance. source points to the contents
+// in the image, or is NULL if the part is zero filled. Offsets and lengths
+// are multiples of four.
+struct image_segment {
+    uint32 offset;
+    uint32 length;
+    void* source;
+};
+
+// a binary as package.py describes it, the layout is written by
+// create_packaged_bin_struct in package.py. Segments and relocations are
+// stored in the image after the kernel, segments with the same contents are
+// only stored once.
+struct packaged_binary {
+    int binid;
+    uint32 entrypoint;              // offset of the entrypoint into the binary
+    uint32 size;                    // memory needed by one instance
+    uint32 link_base;               // address the binary was linked at
+    uint32 segment_count;
+    struct image_segment* segments;
+    uint32 reloc_count;
+    uint32* relocs;                 // offsets of words holding absolute addresses
+};
+
+// the binaries packaged with the kernel, populated by package.py. Binaries
+// on the boot disk are added when its directory is read.
+extern struct packaged_binary binary_table[PACKAGED_BINARY_COUNT];
+
+// the end of the image, memory after it is free, patched by package.py
+extern void* image_end;
+
+// when package.py compresses the segments, they are stored as one lz4 block
+// which is expanded to dest at boot. source is NULL for uncompressed images.
+struct packed_image {
+    byte* source;
+    uint32 length;
+    byte* dest;
+    uint32 size;
+};
+
+extern struct packed_image packed_image;
+
+// expand the compressed segments of the image, has to run before the first
+// binary is loaded
+void loader_unpack_image();
+
+// A disk written by package.py starts with a directory, a header followed by
+// one entry per binary. The rest of the disk holds one record per binary:
+// its segment table, its relocation table and the contents of its segments.
+// The sources of the segments are offsets into the record.
+#define DISK_MAGIC 0x4b424d45   // "EMBK"
+#define DISK_VERSION 1
+
+struct disk_header {
+    uint32 magic;
+    uint32 version;
+    uint32 count;               // number of entries
+    uint32 dir_blocks;          // blocks taken up by header and entries
+};
+
+// the binary is started at boot
+#define DISK_AUTOSTART 1
+
+struct disk_entry {
+    int binid;
+    uint32 entrypoint;
+    uint32 size;
+    uint32 link_base;
+    uint32 segment_count;
+    uint32 reloc_count;
+    uint32 flags;
+    uint32 block;               // first block of the record
+    uint32 length;              // length of the record in bytes
+};
+
+// add the binaries on the boot disk to the binary table, they are read from
+// the disk when they are first started
+void loader_read_directory();
+
+// if the binary should be started at boot
+int loader_autostart(int binid);
+
+// start a new process from the packaged binary with the given id. arg is
+// passed to the process in a1, a0 holds its pid as usual. spawner is the pid
+// of the process that asked for it, 0 at boot. Each instance needs
+// bin->size bytes, read-only segments are copied per instance as well, they
+// are not shared between instances of a binary.
+optional_pcbptr loader_spawn(int binid, int arg, int spawner);
+
+// called when the root process of a binary instance is destroyed
+void loader_release(loaded_binary* bin);
+
+#endif
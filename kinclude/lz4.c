@@ -0,0 +1,74 @@
+#include "lz4.h"
+
+// An lz4 block is a list of sequences. Each sequence starts with a token byte,
+// its upper nibble is the number of literal bytes that follow, its lower
+// nibble the length of the match after them minus four. A nibble of 15 is
+// extended by the following bytes until one is not 255. The literals are
+// followed by a two byte little endian offset back into the output, the match
+// is copied from there. The last sequence only has literals.
+
+// read the extension bytes of a length nibble
+static inline int read_length(byte** in, byte* end, size_t* length)
+{
+    byte b;
+
+    do {
+        if (*in >= end)
+            return 0;
+        b = *(*in)++;
+        *length += b;
+    } while (b == 255);
+
+    return 1;
+}
+
+optional_int lz4_decompress(byte* dest, size_t size, byte* src, size_t len)
+{
+    byte* in = src;
+    byte* in_end = src + len;
+    byte* out = dest;
+    byte* out_end = dest + size;
+
+    while (in < in_end) {
+        byte token = *in++;
+        size_t literals = token >> 4;
+
+        if (literals == 15 && !read_length(&in, in_end, &literals))
+            return (optional_int) { .error = EINVAL };
+
+        if (literals > (size_t) (in_end - in))
+            return (optional_int) { .error = EINVAL };
+        if (literals > (size_t) (out_end - out))
+            return (optional_int) { .error = ENOBUFS };
+
+        for (size_t i = 0; i < literals; i++)
+            *out++ = *in++;
+
+        // the last sequence ends after its literals
+        if (in == in_end)
+            break;
+
+        if (in_end - in < 2)
+            return (optional_int) { .error = EINVAL };
+
+        size_t offset = in[0] | (in[1] << 8);
+        size_t match = (token & 15);
+        in += 2;
+
+        if (match == 15 && !read_length(&in, in_end, &match))
+            return (optional_int) { .error = EINVAL };
+        match += 4;
+
+        if (offset == 0 || offset > (size_t) (out - dest))
+            return (optional_int) { .error = EINVAL };
+        if (match > (size_t) (out_end - out))
+            return (optional_int) { .error = ENOBUFS };
+
+        // the match may overlap the bytes it produces, copy bytewise
+        byte* from = out - offset;
+        for (size_t i = 0; i < match; i++)
+            *out++ = *from++;
+    }
+
+    return (optional_int) { .value = out - dest };
+}
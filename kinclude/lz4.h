@@ -0,0 +1,13 @@
+#ifndef H_LZ4
+#define H_LZ4
+
+#include "../kernel.h"
+#include "ktypes.h"
+
+// expand an lz4 block (the raw block format, without frame headers) of len
+// bytes from src into dest, which holds up to size bytes. Returns the number
+// of bytes written, EINVAL for a malformed block or ENOBUFS if dest is too
+// small. package.py compresses the segments of user binaries with it.
+optional_int lz4_decompress(byte* dest, size_t size, byte* src, size_t len);
+
+#endif
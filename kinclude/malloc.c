@@ -3,62 +3,522 @@
 #include "malloc.h"
 #include "ecall.h"
 #include "io.h"
+#include "trace.h"
 
 // information about the systems memory layout is stored here
 static struct malloc_info global_malloc_info = { 0 };
-// this pointer points to the end of unused memory
-static void* allocate_memory_end;
-// this stack holds currently unused program stacks
-// it is a stack in the sense that you can push and pop variables
-static struct voidptr_stack unused_stacks;
-
-void stash_stack(void* stack_top)
-{
-    if (voidptr_stack_push(&unused_stacks, stack_top) == 0) {
-        // if this happens, we know we messed up and created more stacks than we
-        // could ever have processes running simultaneously!
-        // we probably have an erro in retrieving stashed stacks?
-        dbgln("cannot stash stack, no space left! This should never ever happen!", 65);
+
+/*
+ * Buddy allocator
+ *
+ * the memory between the loaded binaries and the end of memory is split into
+ * naturally aligned blocks of 2^order bytes. Free blocks of each order are
+ * kept in a doubly linked list stored inside the blocks themselves, so
+ * allocating and freeing take at most one step per order.
+ *
+ * the block map holds one byte for every minimum sized block. The byte of the
+ * first minimum block of every block holds its order, and BLOCK_FREE if it is
+ * free. All other bytes are zero.
+ */
+
+#define ORDER_COUNT (MALLOC_MAX_ORDER + 1)
+#define BLOCK_FREE 0x80
+
+struct free_block {
+    struct free_block* next;
+    struct free_block* prev;
+};
+
+static struct free_block* free_lists[ORDER_COUNT];
+static byte* block_map;
+static uint32 heap_start;
+static uint32 heap_end;
+
+// region descriptors, unused ones are kept in a singly linked list
+static struct mem_region region_pool[MEM_REGION_COUNT];
+static struct mem_region* unused_regions;
+
+static inline byte* block_map_entry(uint32 addr)
+{
+    return &block_map[(addr - heap_start) >> MALLOC_MIN_ORDER];
+}
+
+static void free_list_push(uint32 addr, int order)
+{
+    struct free_block* block = (struct free_block*) addr;
+
+    block->prev = NULL;
+    block->next = free_lists[order];
+    if (block->next != NULL)
+        block->next->prev = block;
+    free_lists[order] = block;
+
+    *block_map_entry(addr) = order | BLOCK_FREE;
+}
+
+static void free_list_remove(uint32 addr, int order)
+{
+    struct free_block* block = (struct free_block*) addr;
+
+    if (block->prev != NULL)
+        block->prev->next = block->next;
+    else
+        free_lists[order] = block->next;
+
+    if (block->next != NULL)
+        block->next->prev = block->prev;
+
+    *block_map_entry(addr) = 0;
+}
+
+// returns the smallest order whose blocks can hold size bytes
+static int order_for_size(size_t size)
+{
+    int order = MALLOC_MIN_ORDER;
+
+    while (order <= MALLOC_MAX_ORDER && ((size_t) 1 << order) < size)
+        order++;
+
+    return order;
+}
+
+// check if the block at addr is free and of the given order
+static inline int block_is_free(uint32 addr, int order)
+{
+    if (addr < heap_start || addr + (1u << order) > heap_end)
+        return 0;
+    return *block_map_entry(addr) == (order | BLOCK_FREE);
+}
+
+// hand the range [start, end) to the buddy allocator as a set of naturally
+// aligned blocks, largest first
+static void buddy_add_range(uint32 start, uint32 end)
+{
+    while (start + (1u << MALLOC_MIN_ORDER) <= end) {
+        int order = MALLOC_MIN_ORDER;
+
+        while (order < MALLOC_MAX_ORDER &&
+               (start & ((2u << order) - 1)) == 0 &&
+               start + (2u << order) <= end)
+            order++;
+
+        free_list_push(start, order);
+        start += 1u << order;
+    }
+}
+
+static void buddy_init(uint32 start, uint32 end)
+{
+    uint32 min_block = 1u << MALLOC_MIN_ORDER;
+
+    heap_start = (start + min_block - 1) & ~(min_block - 1);
+    heap_end = end & ~(min_block - 1);
+
+    if (heap_end <= heap_start) {
+        heap_end = heap_start;
+        return;
+    }
+
+    // the block map lives at the start of the heap, it covers itself
+    block_map = (byte*) heap_start;
+    uint32 map_size = (heap_end - heap_start) >> MALLOC_MIN_ORDER;
+    uint32 map_end = (heap_start + map_size + min_block - 1) & ~(min_block - 1);
+
+    for (uint32 i = 0; i < map_size; i++)
+        block_map[i] = 0;
+
+    buddy_add_range(map_end, heap_end);
+}
+
+optional_voidptr malloc_block(size_t size)
+{
+    int order = order_for_size(size);
+
+    if (order > MALLOC_MAX_ORDER)
+        return (optional_voidptr) { .error = ENOMEM };
+
+    // find the smallest free block that is large enough
+    int found = order;
+
+    while (found <= MALLOC_MAX_ORDER && free_lists[found] == NULL)
+        found++;
+
+    if (found > MALLOC_MAX_ORDER)
+        return (optional_voidptr) { .error = ENOMEM };
+
+    uint32 addr = (uint32) free_lists[found];
+    free_list_remove(addr, found);
+
+    // split it until it has the requested size, freeing the upper halves
+    while (found > order) {
+        found--;
+        free_list_push(addr + (1u << found), found);
+    }
+
+    *block_map_entry(addr) = order;
+    trace(TRACE_ALLOC, 0, addr, 1u << order);
+    return (optional_voidptr) { .value = (void*) addr };
+}
+
+void free_block(void* ptr)
+{
+    uint32 addr = (uint32) ptr;
+    int order = *block_map_entry(addr);
+
+    trace(TRACE_FREE, 0, addr, 1u << order);
+
+    // merge with the buddy as long as it is free
+    while (order < MALLOC_MAX_ORDER) {
+        uint32 buddy = addr ^ (1u << order);
+
+        if (!block_is_free(buddy, order))
+            break;
+
+        free_list_remove(buddy, order);
+        *block_map_entry(addr) = 0;
+        addr = addr < buddy ? addr : buddy;
+        order++;
+    }
+
+    free_list_push(addr, order);
+}
+
+size_t block_size(void* ptr)
+{
+    return (size_t) 1 << (*block_map_entry((uint32) ptr) & ~BLOCK_FREE);
+}
+
+// double the size of a block in place, this works if the block is the lower
+// half of its parent and its buddy is free. Returns 1 on success.
+int grow_block(void* ptr)
+{
+    uint32 addr = (uint32) ptr;
+    int order = *block_map_entry(addr);
+    uint32 buddy = addr + (1u << order);
+
+    if (order >= MALLOC_MAX_ORDER || (addr & (1u << order)) != 0)
+        return 0;
+    if (!block_is_free(buddy, order))
+        return 0;
+
+    free_list_remove(buddy, order);
+    *block_map_entry(addr) = order + 1;
+    return 1;
+}
+
+// allocate a block which is the lower half of its parent and whose buddy is
+// free, so that it can grow in place. This is done by allocating a block of
+// twice the size and freeing the upper half again.
+static optional_voidptr malloc_growable_block(size_t size)
+{
+    optional_voidptr block_or_err = malloc_block(size * 2);
+
+    if (has_error(block_or_err))
+        return malloc_block(size);
+
+    uint32 addr = (uint32) block_or_err.value;
+    int order = *block_map_entry(addr) - 1;
+
+    *block_map_entry(addr) = order;
+    free_list_push(addr + (1u << order), order);
+    return block_or_err;
+}
+
+/*
+ * Process memory regions
+ *
+ * memory requested by user programs is owned by the process at the root of
+ * the thread tree, so it is shared by all of its threads and reclaimed when
+ * the process exits.
+ */
+
+static struct process_control_block* region_owner(struct process_control_block* pcb)
+{
+    while (pcb->parent != NULL)
+        pcb = pcb->parent;
+    return pcb;
+}
+
+// count the regions of a process, each one needs a pmp entry
+static int region_count(struct process_control_block* owner)
+{
+    int count = 0;
+
+    for (struct mem_region* region = owner->regions; region != NULL; region = region->next)
+        count++;
+
+    return count;
+}
+
+static struct mem_region* region_add(struct process_control_block* pcb, void* start)
+{
+    struct mem_region* region = unused_regions;
+    struct process_control_block* owner = region_owner(pcb);
+
+    if (region == NULL || region_count(owner) >= MEM_REGIONS_PER_PROCESS)
+        return NULL;
+
+    unused_regions = region->next;
+
+    region->start = start;
+    region->size = block_size(start);
+    region->owner = owner;
+    region->next = owner->regions;
+    owner->regions = region;
+    owner->mem_version++;
+
+    return region;
+}
+
+// unlink the region starting at start from the owners list
+static struct mem_region* region_remove(struct process_control_block* owner, void* start)
+{
+    struct mem_region** it = &owner->regions;
+
+    while (*it != NULL) {
+        struct mem_region* region = *it;
+
+        if (region->start == start) {
+            *it = region->next;
+            region->next = NULL;
+            owner->mem_version++;
+            return region;
+        }
+        it = &region->next;
+    }
+
+    return NULL;
+}
+
+// allocate a block for a process and record it as one of its regions
+optional_voidptr malloc_region(struct process_control_block* pcb, size_t size)
+{
+    if (size == 0)
+        return (optional_voidptr) { .error = EINVAL };
+
+    optional_voidptr block_or_err = malloc_block(size);
+
+    if (has_error(block_or_err))
+        return block_or_err;
+
+    if (region_add(pcb, block_or_err.value) == NULL) {
+        free_block(block_or_err.value);
+        return (optional_voidptr) { .error = ENOBUFS };
+    }
+
+    return block_or_err;
+}
+
+int free_region(struct process_control_block* pcb, void* start)
+{
+    struct process_control_block* owner = region_owner(pcb);
+
+    // the sbrk heap can only shrink through sbrk
+    if (owner->heap != NULL && owner->heap->start == start)
+        return EINVAL;
+
+    struct mem_region* region = region_remove(owner, start);
+
+    if (region == NULL)
+        return EINVAL;
+
+    free_block(region->start);
+    region->owner = NULL;
+    region->next = unused_regions;
+    unused_regions = region;
+    return 0;
+}
+
+// move the program break of a process, returns the old break
+optional_voidptr malloc_sbrk(struct process_control_block* pcb, int increment)
+{
+    struct process_control_block* owner = region_owner(pcb);
+
+    // the heap is allocated with the first call. It can only grow in place
+    // while its buddy is free, so start with a reasonably large block
+    if (owner->heap == NULL) {
+        if (increment <= 0)
+            return (optional_voidptr) { .value = NULL };
+
+        size_t size = increment > SBRK_MIN_HEAP ? (size_t) increment : SBRK_MIN_HEAP;
+        optional_voidptr block_or_err = malloc_growable_block(size);
+
+        if (has_error(block_or_err))
+            return block_or_err;
+
+        owner->heap = region_add(owner, block_or_err.value);
+
+        if (owner->heap == NULL) {
+            free_block(block_or_err.value);
+            return (optional_voidptr) { .error = ENOBUFS };
+        }
+
+        owner->heap_brk = 0;
+    }
+
+    struct mem_region* heap = owner->heap;
+    size_t old_brk = owner->heap_brk;
+
+    if (increment < 0 && (size_t) -increment > old_brk)
+        return (optional_voidptr) { .error = EINVAL };
+
+    size_t new_brk = old_brk + increment;
+
+    // grow the heap block in place until the new break fits
+    while (new_brk > heap->size) {
+        if (!grow_block(heap->start))
+            return (optional_voidptr) { .error = ENOMEM };
+        heap->size = block_size(heap->start);
+        owner->mem_version++;
+    }
+
+    owner->heap_brk = new_brk;
+    return (optional_voidptr) { .value = (byte*) heap->start + old_brk };
+}
+
+// find the region starting at start
+static struct mem_region* region_at(void* start)
+{
+    for (int i = 0; i < MEM_REGION_COUNT; i++) {
+        if (region_pool[i].owner != NULL && region_pool[i].start == start)
+            return &region_pool[i];
     }
+    return NULL;
 }
 
+int malloc_transfer_owner(void* start, struct process_control_block* sender)
+{
+    struct mem_region* region = region_at(start);
+
+    if (region == NULL)
+        return 0;
+    if (region->owner != region_owner(sender))
+        return -1;
+    return region->owner->pid;
+}
+
+// hand a region to another process, used when a buffer is passed through a
+// channel. The region is only moved if it still belongs to the process with
+// the pid owner, the sender could have freed it before the message arrived.
+// If the new owner has no free region slot, the region stays where it is.
+void malloc_transfer_region(void* start, int owner, struct process_control_block* new_owner)
+{
+    struct mem_region* region = region_at(start);
+
+    new_owner = region_owner(new_owner);
+
+    if (region == NULL || region->owner->pid != owner || region->owner->status == PROC_DEAD)
+        return;
+
+    // the heap stays with its process
+    if (region->owner == new_owner || region->owner->heap == region)
+        return;
+    if (region_count(new_owner) >= MEM_REGIONS_PER_PROCESS)
+        return;
+
+    region_remove(region->owner, start);
+    region->owner = new_owner;
+    region->next = new_owner->regions;
+    new_owner->regions = region;
+    new_owner->mem_version++;
+}
+
+// free all regions of an exiting process
+void malloc_free_process_memory(struct process_control_block* pcb)
+{
+    // threads don't own memory
+    if (pcb->parent != NULL)
+        return;
+
+    while (pcb->regions != NULL) {
+        struct mem_region* region = pcb->regions;
+
+        pcb->regions = region->next;
+        free_block(region->start);
+        region->owner = NULL;
+        region->next = unused_regions;
+        unused_regions = region;
+    }
+
+    pcb->heap = NULL;
+    pcb->heap_brk = 0;
+}
+
+/*
+ * Stacks
+ *
+ * stacks are buddy blocks, so their size is a power of two. Freed stacks are
+ * kept in a free list per size class (up to STACK_CACHE_DEPTH each), so that
+ * thread churn doesn't split and merge buddy blocks all the time. The list
+ * links are stored at the bottom of the unused stacks.
+ */
+
+struct cached_stack {
+    struct cached_stack* next;
+};
+
+static struct cached_stack* stack_cache[ORDER_COUNT];
+static int stack_cache_len[ORDER_COUNT];
+
 // this function is called by the kernels init() function after it parsed the
 // list of loaded binaries and calculated the available memory for general allocation
 void malloc_init(struct malloc_info* given_info)
 {
     // save the passed info
     global_malloc_info = *given_info;
-    allocate_memory_end = given_info->allocate_memory_end;
-    allocate_memory_end = (void*) (((int) allocate_memory_end) - PROCESS_COUNT);
-    voidptr_stack_new(&unused_stacks, (void**) allocate_memory_end, PROCESS_COUNT);
+
+    // everything after the loaded binaries is managed by the buddy allocator
+    buddy_init((uint32) given_info->allocate_memory_start, (uint32) given_info->allocate_memory_end);
+
+    for (int i = 0; i < MEM_REGION_COUNT; i++) {
+        region_pool[i].next = unused_regions;
+        unused_regions = &region_pool[i];
+    }
 }
 
-// allocate stack and return a pointer to the *end* of the allocated region
-// this doesn't reuse stack from functions which exited
-optional_voidptr malloc_stack()
+// allocate a stack of at least size bytes and return a pointer to the *end*
+// of the allocated region. The actual size is written to *size.
+optional_voidptr malloc_stack(size_t* size)
 {
-    // try to reuse a stack top
-    void* stack_top = voidptr_stack_pop(&unused_stacks);
+    if (*size < MIN_STACK_SIZE)
+        *size = MIN_STACK_SIZE;
+    if (*size > MAX_STACK_SIZE)
+        return (optional_voidptr) { .error = EINVAL };
+
+    int order = order_for_size(*size);
+    *size = (size_t) 1 << order;
 
-    if (stack_top != NULL) {
-        return (optional_voidptr) { .value = stack_top };
+    // try to reuse a stack of the same size class
+    struct cached_stack* cached = stack_cache[order];
+
+    if (cached != NULL) {
+        stack_cache[order] = cached->next;
+        stack_cache_len[order]--;
+        return (optional_voidptr) { .value = (byte*) cached + *size };
     }
 
-    // otherwise allocate a new stack at the end of available memory
-    void* new_alloc_end = (void*) (((int) allocate_memory_end) - USER_STACK_SIZE);
+    // otherwise allocate a new block
+    optional_voidptr block_or_err = malloc_block(*size);
 
-    // check if we ran out of space
-    if (new_alloc_end < global_malloc_info.allocate_memory_start)
-        return (optional_voidptr) { .error = ENOMEM };
+    if (has_error(block_or_err))
+        return block_or_err;
 
-    stack_top = allocate_memory_end;
-    allocate_memory_end = new_alloc_end;
-    return (optional_voidptr) { .value = stack_top };
+    return (optional_voidptr) { .value = (byte*) block_or_err.value + *size };
 }
 
-// a stack is not returned to the general memory pool (since EMBARK has no such
-// pool) but rather just added to the pool of free process stacks.
-void free_stack(void* stack_top)
+// put a stack into the free list of its size class, or give it back to the
+// buddy allocator if that list is full
+void free_stack(void* stack_top, size_t size)
 {
-    stash_stack(stack_top);
+    int order = order_for_size(size);
+    struct cached_stack* stack = (struct cached_stack*) ((byte*) stack_top - size);
+
+    if (stack_cache_len[order] >= STACK_CACHE_DEPTH) {
+        free_block(stack);
+        return;
+    }
+
+    stack->next = stack_cache[order];
+    stack_cache[order] = stack;
+    stack_cache_len[order]++;
 }
@@ -3,13 +3,43 @@
 
 #include "ktypes.h"
 
+// the general purpose allocator is a buddy allocator, it hands out naturally
+// aligned blocks with a power of two size between these two orders
+#define MALLOC_MIN_ORDER 7          // 128 bytes
+#define MALLOC_MAX_ORDER 24         // 16 MiB
+
 struct malloc_info {
     void* allocate_memory_end;
     void* allocate_memory_start;
 };
 
-optional_voidptr malloc_stack();
-void free_stack(void* stack_top);
+// a block of memory owned by a process (mmap region or sbrk heap)
+struct mem_region {
+    void* start;
+    size_t size;
+    struct process_control_block* owner;
+    struct mem_region* next;
+};
+
+optional_voidptr malloc_stack(size_t* size);
+void free_stack(void* stack_top, size_t size);
+
+// general purpose blocks, the size is rounded up to a power of two
+optional_voidptr malloc_block(size_t size);
+void free_block(void* ptr);
+size_t block_size(void* ptr);
+int grow_block(void* ptr);
+
+// memory regions owned by processes
+optional_voidptr malloc_region(struct process_control_block* pcb, size_t size);
+int free_region(struct process_control_block* pcb, void* start);
+optional_voidptr malloc_sbrk(struct process_control_block* pcb, int increment);
+// check a buffer sent over a channel. Returns the pid of the process owning
+// the region starting at start, 0 if there is none, or -1 if the region
+// doesn't belong to the process of sender.
+int malloc_transfer_owner(void* start, struct process_control_block* sender);
+void malloc_transfer_region(void* start, int owner, struct process_control_block* new_owner);
+void malloc_free_process_memory(struct process_control_block* pcb);
 
 void malloc_init(struct malloc_info* info);
 
@@ -0,0 +1,204 @@
+#include "../kernel.h"
+#include "ktypes.h"
+#include "pmp.h"
+#include "csr.h"
+#include "io.h"
+#include "malloc.h"
+
+// linker symbols, the thread finalizer section is placed right after _end
+extern byte _ftext, _end, _ethread_fini;
+
+// the pmp state that is currently programmed into the csrs of each hart
+static struct pmp_image loaded_images[HART_COUNT];
+// the process the loaded image belongs to
+static struct process_control_block* loaded_pcbs[HART_COUNT];
+
+// csr numbers have to be immediates, so every register gets its own write
+#define PMP_CASE(csr, n) case n: CSR_WRITE(csr + n, value); break;
+
+static void pmp_write_cfg(int index, uint32 value)
+{
+    switch (index) {
+        PMP_CASE(CSR_PMPCFG, 0)
+        PMP_CASE(CSR_PMPCFG, 1)
+        PMP_CASE(CSR_PMPCFG, 2)
+        PMP_CASE(CSR_PMPCFG, 3)
+    }
+}
+
+static void pmp_write_addr(int index, uint32 value)
+{
+    switch (index) {
+        PMP_CASE(CSR_PMPADDR, 0)
+        PMP_CASE(CSR_PMPADDR, 1)
+        PMP_CASE(CSR_PMPADDR, 2)
+        PMP_CASE(CSR_PMPADDR, 3)
+        PMP_CASE(CSR_PMPADDR, 4)
+        PMP_CASE(CSR_PMPADDR, 5)
+        PMP_CASE(CSR_PMPADDR, 6)
+        PMP_CASE(CSR_PMPADDR, 7)
+        PMP_CASE(CSR_PMPADDR, 8)
+        PMP_CASE(CSR_PMPADDR, 9)
+        PMP_CASE(CSR_PMPADDR, 10)
+        PMP_CASE(CSR_PMPADDR, 11)
+        PMP_CASE(CSR_PMPADDR, 12)
+        PMP_CASE(CSR_PMPADDR, 13)
+        PMP_CASE(CSR_PMPADDR, 14)
+        PMP_CASE(CSR_PMPADDR, 15)
+    }
+}
+
+static void pmp_set(struct pmp_image* img, int entry, uint32 addr, byte cfg)
+{
+    int shift = (entry & 3) * 8;
+
+    img->addr[entry] = addr;
+    img->cfg[entry >> 2] = (img->cfg[entry >> 2] & ~(0xffu << shift)) | ((uint32) cfg << shift);
+}
+
+// encode a naturally aligned power of two region (at least 8 bytes)
+static inline uint32 pmp_napot(void* start, size_t size)
+{
+    return PMP_ADDR(start) | ((size >> 3) - 1);
+}
+
+static inline void pmp_set_stack(struct pmp_image* img, int guard_entry, int stack_entry, struct process_control_block* pcb)
+{
+    void* bottom = (byte*) pcb->stack_top - pcb->stack_size;
+
+    pmp_set(img, guard_entry, pmp_napot(bottom, STACK_GUARD_SIZE), PMP_NAPOT);
+    pmp_set(img, stack_entry, pmp_napot(bottom, pcb->stack_size), PMP_NAPOT | PMP_R | PMP_W);
+}
+
+// every hart has its own pmp registers, so this runs on each of them
+void pmp_init()
+{
+    struct pmp_image* loaded = &loaded_images[hart_id()];
+
+    // these entries use Top-of-Range mode - read more in the privileged spec p.49
+    // we disallow all access to 0x0-kernel_start from user and machine mode
+    // and all access to the kernel from user mode, except for the thread
+    // finalizer at its end
+    pmp_set(loaded, PMP_ENTRY_LOW_MEM, PMP_ADDR(&_ftext), PMP_LOCK | PMP_TOR);
+    pmp_set(loaded, PMP_ENTRY_KERNEL, PMP_ADDR(&_end), PMP_TOR);
+    pmp_set(loaded, PMP_ENTRY_THREAD_FINI, PMP_ADDR(&_ethread_fini), PMP_TOR | PMP_X);
+
+#ifdef TEXT_IO_ADDR
+    // user programs may write to the text io device directly
+    size_t io_size = 8;
+
+    while (io_size < TEXT_IO_BUFLEN + 4)
+        io_size <<= 1;
+
+    pmp_set(loaded, PMP_ENTRY_TEXT_IO, pmp_napot((void*) TEXT_IO_ADDR, io_size), PMP_NAPOT | PMP_R | PMP_W);
+#endif
+
+    for (int i = 0; i < PMP_ENTRY_COUNT; i++)
+        pmp_write_addr(i, loaded->addr[i]);
+    for (int i = 0; i < PMP_ENTRY_COUNT / 4; i++)
+        pmp_write_cfg(i, loaded->cfg[i]);
+}
+
+// rebuild the image of a process from its stack, binary and memory regions.
+// Anything not covered by an entry is inaccessible from user mode.
+static void pmp_build(struct process_control_block* pcb, struct process_control_block* root)
+{
+    struct pmp_image* img = &pcb->pmp;
+    struct pmp_image* loaded = &loaded_images[hart_id()];
+
+    // start with the static entries
+    for (int i = 0; i < PMP_FIRST_DYNAMIC_ENTRY; i++)
+        pmp_set(img, i, loaded->addr[i], (loaded->cfg[i >> 2] >> ((i & 3) * 8)) & 0xff);
+    for (int i = PMP_FIRST_DYNAMIC_ENTRY; i < PMP_ENTRY_COUNT; i++)
+        pmp_set(img, i, 0, 0);
+
+    pmp_set_stack(img, PMP_ENTRY_GUARD, PMP_ENTRY_STACK, pcb);
+
+    // threads may access the stack of their process, arguments are passed there
+    if (root != pcb)
+        pmp_set_stack(img, PMP_ENTRY_ROOT_GUARD, PMP_ENTRY_ROOT_STACK, root);
+
+    pmp_set(img, PMP_ENTRY_BINARY_START, PMP_ADDR(pcb->binary->bounds[0]), 0);
+    pmp_set(img, PMP_ENTRY_BINARY, PMP_ADDR((uint32) pcb->binary->bounds[1] + 3), PMP_TOR | PMP_R | PMP_W | PMP_X);
+
+    // regions are buddy blocks, so they are naturally aligned powers of two
+    int entry = PMP_ENTRY_REGIONS;
+
+    for (struct mem_region* region = root->regions; region != NULL && entry < PMP_ENTRY_COUNT; region = region->next)
+        pmp_set(img, entry++, pmp_napot(region->start, region->size), PMP_NAPOT | PMP_R | PMP_W);
+
+    img->version = root->mem_version;
+}
+
+void pmp_load(struct process_control_block* pcb)
+{
+    struct pmp_image* loaded = &loaded_images[hart_id()];
+    struct process_control_block* root = pcb;
+
+    while (root->parent != NULL)
+        root = root->parent;
+
+    // the image is rebuilt when the memory of the process changed
+    if (pcb->pmp.version != root->mem_version)
+        pmp_build(pcb, root);
+    else if (pcb == loaded_pcbs[hart_id()])
+        return;
+
+    // only write registers that differ from the loaded image, threads of the
+    // same process only differ in their stack entries
+    for (int i = PMP_FIRST_DYNAMIC_ENTRY; i < PMP_ENTRY_COUNT; i++) {
+        if (loaded->addr[i] != pcb->pmp.addr[i]) {
+            loaded->addr[i] = pcb->pmp.addr[i];
+            pmp_write_addr(i, loaded->addr[i]);
+        }
+    }
+
+    for (int i = PMP_FIRST_DYNAMIC_ENTRY / 4; i < PMP_ENTRY_COUNT / 4; i++) {
+        if (loaded->cfg[i] != pcb->pmp.cfg[i]) {
+            loaded->cfg[i] = pcb->pmp.cfg[i];
+            pmp_write_cfg(i, loaded->cfg[i]);
+        }
+    }
+
+    loaded_pcbs[hart_id()] = pcb;
+}
+
+// if [start, start + len) lies inside of [lower, upper), written so that
+// start + len can't wrap around
+static inline int range_inside(uint32 start, uint32 len, void* lower, void* upper)
+{
+    return start >= (uint32) lower && start < (uint32) upper && len <= (uint32) upper - start;
+}
+
+// the part of a stack above its guard
+static inline int stack_contains(struct process_control_block* pcb, uint32 start, uint32 len)
+{
+    byte* bottom = (byte*) pcb->stack_top - pcb->stack_size;
+
+    return range_inside(start, len, bottom + STACK_GUARD_SIZE, pcb->stack_top);
+}
+
+int pmp_user_range(struct process_control_block* pcb, void* ptr, size_t len)
+{
+    struct process_control_block* root = pcb;
+    uint32 start = (uint32) ptr;
+
+    while (root->parent != NULL)
+        root = root->parent;
+
+    if (stack_contains(pcb, start, len) || stack_contains(root, start, len))
+        return 1;
+
+    if (range_inside(start, len, pcb->binary->bounds[0], pcb->binary->bounds[1]))
+        return 1;
+
+    // the same regions pmp_build gives entries to
+    int entry = PMP_ENTRY_REGIONS;
+
+    for (struct mem_region* region = root->regions; region != NULL && entry < PMP_ENTRY_COUNT; region = region->next, entry++) {
+        if (range_inside(start, len, region->start, (byte*) region->start + region->size))
+            return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,44 @@
+#ifndef H_PMP
+#define H_PMP
+
+#include "../kernel.h"
+#include "ktypes.h"
+
+// pmpcfg fields, see the privileged spec chapter 3.7
+#define PMP_R       0x01
+#define PMP_W       0x02
+#define PMP_X       0x04
+#define PMP_TOR     0x08
+#define PMP_NAPOT   0x18
+#define PMP_LOCK    0x80
+
+// pmpaddr registers hold bits 33:2 of an address
+#define PMP_ADDR(addr) (((uint32) (addr)) >> 2)
+
+// entry layout, lower entries take priority
+#define PMP_ENTRY_LOW_MEM       0   // 0x0 up to the kernel, locked
+#define PMP_ENTRY_KERNEL        1   // kernel image, no user access
+#define PMP_ENTRY_THREAD_FINI   2   // thread finalizer, executable
+#define PMP_ENTRY_TEXT_IO       3   // text io device, if configured
+#define PMP_ENTRY_GUARD         4   // guard at the bottom of the own stack
+#define PMP_ENTRY_ROOT_GUARD    5   // guard at the bottom of the root stack
+#define PMP_ENTRY_STACK         6   // own stack
+#define PMP_ENTRY_ROOT_STACK    7   // stack of the root process (threads only)
+#define PMP_ENTRY_BINARY_START  8   // lower bound for the binary entry
+#define PMP_ENTRY_BINARY        9   // the loaded binary
+#define PMP_ENTRY_REGIONS       10  // mmap regions and the sbrk heap
+// entries before this one are the same for every process
+#define PMP_FIRST_DYNAMIC_ENTRY PMP_ENTRY_GUARD
+
+// program the static entries, must be called before the first process runs
+void pmp_init();
+
+// load the pmp image of a process, called right before switching to it
+void pmp_load(struct process_control_block* pcb);
+
+// returns 1 if all of [ptr, ptr + len) is memory of pcb, the same memory its
+// pmp image gives user mode access to. Ecalls check user pointers with this
+// before the kernel reads or writes through them.
+int pmp_user_range(struct process_control_block* pcb, void* ptr, size_t len);
+
+#endif
@@ -0,0 +1,51 @@
+#include "profile.h"
+#include "csr.h"
+
+// the timer interrupt is armed for the next sample as well as for the end
+// of the time slice, see program_timer_interrupt() in sched.c. Interrupts
+// are disabled in the kernel, so only user code is sampled. Dump the memory
+// and symbolize the samples with profiler.py, it finds them through the
+// profile_buffer symbol in the debug info written by package.py.
+
+#ifdef PROFILE_SAMPLES
+
+struct profile_buffer profile_buffer = {
+    .capacity = PROFILE_SAMPLES,
+    .interval = PROFILE_INTERVAL,
+};
+
+static uint64 next_sample[HART_COUNT];
+
+uint64 profile_deadline()
+{
+    return next_sample[hart_id()];
+}
+
+void profile_timer(uint64 now, struct process_control_block* pcb)
+{
+    if (now < next_sample[hart_id()])
+        return;
+
+    next_sample[hart_id()] = now + PROFILE_INTERVAL;
+
+    if (profile_buffer.count == PROFILE_SAMPLES) {
+        profile_buffer.dropped++;
+        return;
+    }
+
+    uint32 start = (uint32) pcb->binary->bounds[0];
+    struct profile_sample* sample = &profile_buffer.samples[profile_buffer.count++];
+
+    sample->pid = pcb->pid;
+    sample->binid = pcb->binary->binid;
+    sample->hart = hart_id();
+    sample->pc = pcb->pc - start;
+    sample->ra = pcb->regs[REG_RA] - start;
+}
+
+#else
+
+// this is included to prevent "error: ISO C forbids an empty translation unit [-Wpedantic]"
+typedef int make_iso_compilers_happy;
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef H_PROFILE
+#define H_PROFILE
+
+#include "../kernel.h"
+#include "ktypes.h"
+
+// if the sampling profiler is enabled
+#ifdef PROFILE_SAMPLES
+
+#ifndef PROFILE_INTERVAL
+#error "When defining PROFILE_SAMPLES, please also provide PROFILE_INTERVAL, otherwise no samples are taken!"
+#endif
+
+// a sample of the user program running on a hart. Addresses are offsets into
+// the binary, so samples of private copies symbolize like the original.
+struct profile_sample {
+    int pid;
+    unsigned short binid;
+    unsigned short hart;
+    uint32 pc;      // offset of the interrupted instruction
+    uint32 ra;      // offset of the return address, the likely caller
+};
+
+// samples are written under the kernel lock. Once the buffer is full, new
+// samples are only counted in dropped.
+struct profile_buffer {
+    unsigned int count;
+    unsigned int dropped;
+    unsigned int capacity;
+    unsigned int interval;
+    struct profile_sample samples[PROFILE_SAMPLES];
+};
+
+// the time at which the next sample is due on this hart
+uint64 profile_deadline();
+
+// take a sample of pcb if one is due, called from the timer interrupt
+void profile_timer(uint64 now, struct process_control_block* pcb);
+
+// without the profiler, samples are never due
+#else
+
+#define profile_deadline() (~0ull)
+#define profile_timer(now, pcb) ((void) 0)
+
+#endif
+#endif
@@ -0,0 +1,163 @@
+#include "../kernel.h"
+#include "ktypes.h"
+#include "ring.h"
+#include "ecall.h"
+#include "sched.h"
+#include "pmp.h"
+
+// A batch is processed in order. Each submission is executed through the
+// ecall table as if the process had trapped with its arguments in a0 to a3,
+// and its result is posted to the completion queue. If a submission blocks
+// (join, sleep, futex wait, ...), the process blocks with it. The wakeup
+// writes the result into a0/a1 as usual, and the scheduler calls
+// ring_resume() to post it and continue with the batch before the process
+// returns to user mode. A whole batch therefore costs a single trap.
+
+static inline struct ring_sqe* ring_sqes(struct ring_header* ring)
+{
+    return (struct ring_sqe*) (ring + 1);
+}
+
+static inline struct ring_cqe* ring_cqes(struct ring_header* ring, int entries)
+{
+    return (struct ring_cqe*) (ring_sqes(ring) + entries);
+}
+
+static inline uint32 ring_size(int entries)
+{
+    return sizeof(struct ring_header) + entries * (sizeof(struct ring_sqe) + sizeof(struct ring_cqe));
+}
+
+// the ring has to stay in the memory of the process, a submission might have
+// unmapped it. A ring that is gone is unregistered.
+static int ring_valid(struct process_control_block* pcb)
+{
+    if (pcb->ring != NULL && pmp_user_range(pcb, pcb->ring, ring_size(pcb->ring_entries)))
+        return 1;
+
+    pcb->ring = NULL;
+    pcb->ring_entries = 0;
+    return 0;
+}
+
+// these can't be submitted, they would end or nest the batch
+static inline int ring_opcode_allowed(int opcode)
+{
+    return opcode != ECALL_EXIT && opcode != ECALL_RING_SETUP && opcode != ECALL_RING_ENTER;
+}
+
+int ring_setup(struct process_control_block* pcb, struct ring_header* ring, int entries)
+{
+    if (ring == NULL) {
+        pcb->ring = NULL;
+        pcb->ring_entries = 0;
+        return 0;
+    }
+
+    // entries must be a power of two, so the indices can wrap freely
+    if (entries < 1 || entries > RING_MAX_ENTRIES || (entries & (entries - 1)) != 0)
+        return EINVAL;
+
+    // the kernel writes completions into the ring, so it has to be memory of
+    // the process
+    if (((uint32) ring & 3) != 0 || !pmp_user_range(pcb, ring, ring_size(entries)))
+        return EINVAL;
+
+    pcb->ring = ring;
+    pcb->ring_entries = entries;
+    ring->sq_head = ring->sq_tail;
+    ring->cq_tail = ring->cq_head;
+
+    return 0;
+}
+
+// post the result currently held in a0 to a3 for the submission at sq_head
+static void ring_complete(struct process_control_block* pcb)
+{
+    struct ring_header* ring = pcb->ring;
+    unsigned int mask = pcb->ring_entries - 1;
+    struct ring_sqe* sqe = &ring_sqes(ring)[ring->sq_head & mask];
+    struct ring_cqe* cqe = &ring_cqes(ring, pcb->ring_entries)[ring->cq_tail & mask];
+
+    cqe->user_data = sqe->user_data;
+    cqe->error = pcb->regs[REG_A0];
+    cqe->value = pcb->regs[REG_A0 + 1];
+    cqe->extra[0] = pcb->regs[REG_A0 + 2];
+    cqe->extra[1] = pcb->regs[REG_A0 + 3];
+
+    ring->cq_tail++;
+    ring->sq_head++;
+    pcb->ring_completed++;
+}
+
+// run submissions until the queue is empty, the completion queue is full or
+// the process blocks. Returns the result of the blocking submission, or the
+// number of completed submissions.
+static optional_int ring_process(struct process_control_block* pcb)
+{
+    struct ring_header* ring = pcb->ring;
+    unsigned int mask = pcb->ring_entries - 1;
+    int* args = &pcb->regs[REG_A0];
+
+    while (ring_valid(pcb) && ring->sq_head != ring->sq_tail &&
+           ring->cq_tail - ring->cq_head < (unsigned int) pcb->ring_entries) {
+        struct ring_sqe* sqe = &ring_sqes(ring)[ring->sq_head & mask];
+        optional_int result;
+
+        // load the arguments into the registers the handlers expect them in
+        for (int i = 0; i < 4; i++)
+            args[i] = sqe->args[i];
+        args[4] = 0;
+
+        if (ring_opcode_allowed(sqe->opcode))
+            result = ecall_dispatch(sqe->opcode, args, pcb);
+        else
+            result = (optional_int) { .error = EINVAL };
+
+        args[0] = result.error;
+        args[1] = result.value;
+
+        // if the submission blocked, it completes when the process wakes up
+        if (pcb->status != PROC_RDY) {
+            pcb->ring_busy = 1;
+            return result;
+        }
+
+        if (!ring_valid(pcb))
+            break;
+
+        ring_complete(pcb);
+    }
+
+    pcb->ring_busy = 0;
+
+    if (pcb->ring == NULL)
+        return (optional_int) { .error = EINVAL };
+    return (optional_int) { .value = pcb->ring_completed };
+}
+
+optional_int ring_enter(struct process_control_block* pcb)
+{
+    if (pcb->ring == NULL)
+        return (optional_int) { .error = EINVAL };
+
+    pcb->ring_completed = 0;
+    return ring_process(pcb);
+}
+
+int ring_resume(struct process_control_block* pcb)
+{
+    // the submission that blocked is done now
+    if (ring_valid(pcb))
+        ring_complete(pcb);
+
+    optional_int result = ring_process(pcb);
+
+    if (pcb->status != PROC_RDY)
+        return 0;
+
+    // the batch is finished, return from the ring enter ecall
+    pcb->regs[REG_A0] = result.error;
+    pcb->regs[REG_A0 + 1] = result.value;
+    return 1;
+}
@@ -0,0 +1,17 @@
+#ifndef H_RING
+#define H_RING
+
+#include "../kernel.h"
+#include "ktypes.h"
+
+// register (or unregister, if ring is NULL) the ecall ring of a process
+int ring_setup(struct process_control_block* pcb, struct ring_header* ring, int entries);
+
+// process the submission queue of the calling process
+optional_int ring_enter(struct process_control_block* pcb);
+
+// continue a batch after the process was woken up, returns 1 if the process
+// can return to user mode and 0 if it blocked again
+int ring_resume(struct process_control_block* pcb);
+
+#endif
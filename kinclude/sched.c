@@ -3,6 +3,14 @@
 #include "csr.h"
 #include "io.h"
 #include "malloc.h"
+#include "ring.h"
+#include "pmp.h"
+#include "loader.h"
+#include "trace.h"
+#include "profile.h"
+#include "console.h"
+#include "chan.h"
+#include "spinlock.h"
 
 // use memset provided in boot.S
 extern void memset(int, void*, void*);
@@ -12,18 +20,442 @@ extern int thread_finalizer;
 
 // process list, holds all active and some dead processes
 struct process_control_block processes[PROCESS_COUNT];
-// pointer to the currently scheduled process
-struct process_control_block* current_process = NULL;
-// timer variables to add kernel time back to the processes time slice
-uint64 scheduling_interrupted_start;
-uint64 next_interrupt_scheduled_for;
 // this counter generates process ids
 int next_process_id = 1;
 
+// only one hart can be inside of the kernel at a time. The lock is taken by
+// kernel_enter() at the start of every trap handler and released right before
+// returning to user mode or going idle.
+static spinlock kernel_lock = 0;
+
+// idle loop defined in boot.S
+extern void __attribute__((noreturn)) kernel_idle(int* regs);
+
+// the ready queues hold every runnable process except the ones currently
+// running. Every hart has one queue per real-time priority level, followed by
+// the queue for the fair class. They are linked through the rq_prev/rq_next
+// fields of the pcb, so adding, removing and picking the next process take
+// constant time.
+#define READY_QUEUE_COUNT (SCHED_RT_PRIORITIES + 1)
+
+struct ready_queue {
+    struct process_control_block* head;
+    struct process_control_block* tail;
+};
+
+// scheduling state of a hart, indexed by mhartid
+struct hart_state {
+    // the process running on this hart
+    struct process_control_block* current;
+    // timer variables to add kernel time back to the processes time slice
+    uint64 interrupted_start;
+    uint64 next_interrupt;
+    // runnable processes assigned to this hart
+    struct ready_queue ready_queues[READY_QUEUE_COUNT];
+    int ready_count;
+    // set once the hart entered the scheduler
+    int online;
+    // isolated harts only run processes pinned to them, see ISOLATED_HARTS
+    int isolated;
+    // the idle pcb is "scheduled" while no process can run, its registers are
+    // only written by the trap handler and never restored
+    struct process_control_block idle_pcb;
+    // time at which the current idle period started
+    uint64 idle_start;
+    // total number of time ticks spent idling
+    uint64 idle_time;
+};
+
+static struct hart_state harts[HART_COUNT];
+
+static inline struct hart_state* this_hart()
+{
+    return &harts[hart_id()];
+}
+
+// the state of the executing hart, these read like the globals they replaced
+#define current_process                 (this_hart()->current)
+#define scheduling_interrupted_start    (this_hart()->interrupted_start)
+#define next_interrupt_scheduled_for    (this_hart()->next_interrupt)
+
+static inline int hart_is_idle(struct hart_state* hart)
+{
+    return hart->current == &hart->idle_pcb;
+}
+
+// check if pcb is currently executing on any hart
+static inline int process_is_running(struct process_control_block* pcb)
+{
+    return harts[pcb->hart].current == pcb;
+}
+
+// returns the index of the ready queue a process belongs to, lower indices
+// are scheduled first
+static inline int ready_queue_level(struct process_control_block* pcb)
+{
+    if (pcb->sched_class == SCHED_FIFO)
+        return pcb->priority;
+    return SCHED_RT_PRIORITIES;
+}
+
+// returns the queue a process belongs to on the hart it is assigned to
+static inline struct ready_queue* ready_queue_of(struct process_control_block* pcb)
+{
+    return &harts[pcb->hart].ready_queues[ready_queue_level(pcb)];
+}
+
+static int ready_queue_contains(struct process_control_block* pcb)
+{
+    return pcb->rq_prev != NULL || ready_queue_of(pcb)->head == pcb;
+}
+
+// append a process to the end of its ready queue
+static void ready_queue_push(struct process_control_block* pcb)
+{
+    if (ready_queue_contains(pcb))
+        return;
+
+    struct ready_queue* queue = ready_queue_of(pcb);
+
+    harts[pcb->hart].ready_count++;
+    pcb->rq_next = NULL;
+    pcb->rq_prev = queue->tail;
+
+    if (queue->tail != NULL)
+        queue->tail->rq_next = pcb;
+    else
+        queue->head = pcb;
+
+    queue->tail = pcb;
+}
+
+// put a process at the front of its ready queue, so it runs next on its level
+static void ready_queue_push_front(struct process_control_block* pcb)
+{
+    if (ready_queue_contains(pcb))
+        return;
+
+    struct ready_queue* queue = ready_queue_of(pcb);
+
+    harts[pcb->hart].ready_count++;
+    pcb->rq_prev = NULL;
+    pcb->rq_next = queue->head;
+
+    if (queue->head != NULL)
+        queue->head->rq_prev = pcb;
+    else
+        queue->tail = pcb;
+
+    queue->head = pcb;
+}
+
+// unlink a process from its ready queue, does nothing if it is not queued
+static void ready_queue_remove(struct process_control_block* pcb)
+{
+    if (!ready_queue_contains(pcb))
+        return;
+
+    struct ready_queue* queue = ready_queue_of(pcb);
+
+    harts[pcb->hart].ready_count--;
+    if (pcb->rq_prev != NULL)
+        pcb->rq_prev->rq_next = pcb->rq_next;
+    else
+        queue->head = pcb->rq_next;
+
+    if (pcb->rq_next != NULL)
+        pcb->rq_next->rq_prev = pcb->rq_prev;
+    else
+        queue->tail = pcb->rq_prev;
+
+    pcb->rq_prev = NULL;
+    pcb->rq_next = NULL;
+}
+
+// take the process at the front of the highest priority non-empty queue
+static struct process_control_block* ready_queue_pop(struct hart_state* hart)
+{
+    for (int i = 0; i < READY_QUEUE_COUNT; i++) {
+        struct process_control_block* pcb = hart->ready_queues[i].head;
+
+        if (pcb != NULL) {
+            ready_queue_remove(pcb);
+            return pcb;
+        }
+    }
+
+    return NULL;
+}
+
+// check if a process with a higher priority than pcb is waiting to run
+static int ready_queue_has_higher(struct process_control_block* pcb)
+{
+    int level = ready_queue_level(pcb);
+
+    for (int i = 0; i < level; i++) {
+        if (harts[pcb->hart].ready_queues[i].head != NULL)
+            return 1;
+    }
+
+    return 0;
+}
+
+// check if a process may run on a hart. Isolated harts only run processes
+// that are pinned to them.
+static inline int hart_allows(int hart, struct process_control_block* pcb)
+{
+    if (!(pcb->affinity & (1u << hart)))
+        return 0;
+    return !harts[hart].isolated || pcb->affinity == (1u << hart);
+}
+
+// find the highest priority process queued on a hart that may run on thief
+static struct process_control_block* ready_queue_find_allowed(struct hart_state* hart, int thief)
+{
+    for (int i = 0; i < READY_QUEUE_COUNT; i++) {
+        for (struct process_control_block* pcb = hart->ready_queues[i].head; pcb != NULL; pcb = pcb->rq_next) {
+            if (hart_allows(thief, pcb))
+                return pcb;
+        }
+    }
+
+    return NULL;
+}
+
+// take a process from the hart with the most queued processes, used by harts
+// that ran out of work. Processes whose affinity excludes the thief stay.
+static struct process_control_block* ready_queue_steal(struct hart_state* thief)
+{
+    struct process_control_block* stolen = NULL;
+    int victim_count = 0;
+
+    for (int i = 0; i < HART_COUNT; i++) {
+        if (&harts[i] == thief || harts[i].ready_count <= victim_count)
+            continue;
+
+        struct process_control_block* pcb = ready_queue_find_allowed(&harts[i], hart_id());
+
+        if (pcb != NULL) {
+            stolen = pcb;
+            victim_count = harts[i].ready_count;
+        }
+    }
+
+    if (stolen != NULL)
+        ready_queue_remove(stolen);
+
+    return stolen;
+}
+
+// make a runnable process available to the scheduler. It is queued on an idle
+// hart if there is one, otherwise on the hart it ran on last. The target hart
+// is interrupted if it should run the process right away.
+static void ready_queue_enqueue(struct process_control_block* pcb)
+{
+    if (!hart_is_idle(&harts[pcb->hart]) || !hart_allows(pcb->hart, pcb)) {
+        int fallback = -1;
+
+        for (int i = 0; i < HART_COUNT; i++) {
+            if (!hart_allows(i, pcb))
+                continue;
+            if (harts[i].online && hart_is_idle(&harts[i]) && harts[i].ready_count == 0) {
+                fallback = i;
+                break;
+            }
+            if (fallback == -1 || (harts[i].online && !harts[fallback].online))
+                fallback = i;
+        }
+
+        // stay on the last hart if it is allowed and no allowed hart is idle
+        if (fallback != -1 && (!hart_allows(pcb->hart, pcb) || hart_is_idle(&harts[fallback])))
+            pcb->hart = fallback;
+    }
+
+    ready_queue_push(pcb);
+
+    struct hart_state* target = &harts[pcb->hart];
+
+    if (pcb->hart != hart_id() && target->online &&
+        (hart_is_idle(target) || target->current == NULL ||
+         ready_queue_level(pcb) < ready_queue_level(target->current)))
+        send_ipi(pcb->hart);
+}
+
+// put a process that was interrupted back into its ready queue. Real-time
+// processes keep their place in line, fair processes go to the back.
+static void ready_queue_requeue(struct process_control_block* pcb)
+{
+    if (pcb->sched_class == SCHED_FIFO)
+        ready_queue_push_front(pcb);
+    else
+        ready_queue_push(pcb);
+}
+
+// returns the time slice length of a process, 0 means it is not preempted
+// by the timer
+static uint64 scheduler_slice_len(struct process_control_block* pcb)
+{
+    if (pcb->sched_class == SCHED_FIFO)
+        return 0;
+
+    uint64 len = (uint64) TIME_SLICE_LEN * pcb->weight / SCHED_DEFAULT_WEIGHT;
+    return len > 0 ? len : 1;
+}
+
+// the time since the last accounting point of a process is charged to the
+// state it was in: user mode until it traps, kernel mode until it leaves the
+// kernel or gives up the hart, and wait time from becoming runnable until
+// it is picked again.
+static inline void stats_charge(struct process_control_block* pcb, uint64* counter, uint64 now)
+{
+    *counter += now - pcb->stats_mark;
+    pcb->stats_mark = now;
+}
+
+// called at the start of every trap, now is the time the trap was taken
+static inline void stats_trap_entry(uint64 now)
+{
+    struct process_control_block* pcb = current_process;
+
+    if (pcb != NULL && !hart_is_idle(this_hart()))
+        stats_charge(pcb, &pcb->stats.user_time, now);
+}
+
+// the timer queue is a binary min-heap of all processes waiting with a
+// timeout, ordered by their asleep_until field. The earliest deadline is
+// always at the top, so checking for expired timeouts is constant time.
+static struct process_control_block* timer_queue[PROCESS_COUNT];
+static int timer_queue_len = 0;
+
+// place pcb at position pos (0-based) in the heap
+static inline void timer_queue_set(int pos, struct process_control_block* pcb)
+{
+    timer_queue[pos] = pcb;
+    pcb->timer_slot = pos + 1;
+}
+
+// move the element at pos up until the heap property holds
+static void timer_queue_sift_up(int pos)
+{
+    struct process_control_block* pcb = timer_queue[pos];
+
+    while (pos > 0) {
+        int parent = (pos - 1) / 2;
+        if (timer_queue[parent]->asleep_until <= pcb->asleep_until)
+            break;
+        timer_queue_set(pos, timer_queue[parent]);
+        pos = parent;
+    }
+    timer_queue_set(pos, pcb);
+}
+
+// move the element at pos down until the heap property holds
+static void timer_queue_sift_down(int pos)
+{
+    struct process_control_block* pcb = timer_queue[pos];
+
+    while (1) {
+        int child = pos * 2 + 1;
+        if (child >= timer_queue_len)
+            break;
+        // pick the child with the earlier deadline
+        if (child + 1 < timer_queue_len &&
+            timer_queue[child + 1]->asleep_until < timer_queue[child]->asleep_until)
+            child++;
+        if (pcb->asleep_until <= timer_queue[child]->asleep_until)
+            break;
+        timer_queue_set(pos, timer_queue[child]);
+        pos = child;
+    }
+    timer_queue_set(pos, pcb);
+}
+
+// remove a process from the timer queue, does nothing if it is not queued
+static void timer_queue_remove(struct process_control_block* pcb)
+{
+    if (pcb->timer_slot == 0)
+        return;
+
+    int pos = pcb->timer_slot - 1;
+    pcb->timer_slot = 0;
+    timer_queue_len--;
+
+    // move the last element into the hole and restore the heap property
+    if (pos != timer_queue_len) {
+        timer_queue_set(pos, timer_queue[timer_queue_len]);
+        timer_queue_sift_up(pos);
+        timer_queue_sift_down(pos);
+    }
+}
+
+// returns the earliest deadline in the timer queue, or 0 if it is empty
+static inline uint64 timer_queue_next_deadline()
+{
+    if (timer_queue_len == 0)
+        return 0;
+    return timer_queue[0]->asleep_until;
+}
+
+// program mtimecmp for the end of the time slice or the next deadline,
+// whichever comes first
+static void program_timer_interrupt()
+{
+    // isolated harts leave the deadlines of other processes to the rest
+    uint64 deadline = this_hart()->isolated ? 0 : timer_queue_next_deadline();
+    uint64 next = next_interrupt_scheduled_for;
+
+    if (deadline != 0 && deadline < next)
+        next = deadline;
+
+    // the profiler samples the running process in between
+    if (profile_deadline() < next)
+        next = profile_deadline();
+
+    write_mtimecmp(next);
+}
+
+static void release_dead_process(struct process_control_block* pcb);
+
 // run the next process
 void scheduler_run_next()
 {
-    current_process = scheduler_select_free();
+    struct process_control_block* prev = current_process;
+    struct process_control_block* leaving = prev;
+
+    // the kernel time of the old process ends here, if it blocked it gave
+    // up the hart voluntarily
+    if (prev != NULL && prev->status != PROC_DEAD) {
+        stats_charge(prev, &prev->stats.kernel_time, read_time());
+        if (prev->status != PROC_RDY)
+            prev->stats.voluntary_switches++;
+    }
+
+    // the interrupted process goes back into the ready queue, or to another
+    // hart if its affinity no longer allows this one
+    if (current_process != NULL && current_process->status == PROC_RDY) {
+        if (hart_allows(hart_id(), current_process))
+            ready_queue_requeue(current_process);
+        else
+            ready_queue_enqueue(current_process);
+    }
+
+    // the old process is not running anymore, so it is put into a ready queue
+    // if it is woken while selecting the next one, and if it was killed its
+    // memory can be freed now. A process in the middle of an ecall batch
+    // continues it before returning to user mode, if that blocks or kills it
+    // the same holds for it.
+    do {
+        current_process = NULL;
+        if (leaving != NULL && leaving->dying)
+            release_dead_process(leaving);
+        leaving = current_process = scheduler_select_free();
+    } while (current_process->ring_busy && !ring_resume(current_process));
+
+    // a runnable process only loses the hart if another one was picked
+    if (prev != NULL && prev != current_process && prev->status == PROC_RDY)
+        prev->stats.involuntary_switches++;
+    stats_charge(current_process, &current_process->stats.wait_time, read_time());
+
     // set up timer interrupt
     set_next_interrupt();
     scheduler_switch_to(current_process);
@@ -31,102 +463,361 @@ void scheduler_run_next()
 
 void scheudler_init()
 {
-    current_process = processes + PROCESS_COUNT - 1;
+    current_process = NULL;
+}
+
+// called by every hart once the kernel is initialized, starts scheduling
+void scheduler_start()
+{
+    kernel_lock_acquire();
+    this_hart()->isolated = (ISOLATED_HARTS >> hart_id()) & 1;
+    this_hart()->online = 1;
+    scheduler_run_next();
+}
+
+void kernel_lock_acquire()
+{
+    spin_lock(&kernel_lock);
+}
+
+void kernel_lock_release()
+{
+    spin_unlock(&kernel_lock);
+}
+
+// called at the start of every trap handler. Another hart might have killed
+// the interrupted process while this hart was waiting for the lock, in that
+// case a new process is scheduled right away.
+void kernel_enter()
+{
+    uint64 now = read_time();
+
+    kernel_lock_acquire();
+    stats_trap_entry(now);
+
+    struct process_control_block* pcb = current_process;
+
+    if (pcb != NULL && pcb->status == PROC_DEAD && !hart_is_idle(this_hart()))
+        scheduler_run_next();
+}
+
+// prepare to continue the current process after an ecall
+static void scheduler_resume_current()
+{
+    // add time spent in ecall handler to the processes time slice
+    if (scheduler_slice_len(current_process) != 0)
+        next_interrupt_scheduled_for = next_interrupt_scheduled_for + (read_time() - scheduling_interrupted_start);
+    program_timer_interrupt();
+}
+
+// used by the ecall fast path, returns 1 if the current process can continue
+// without a context switch. Otherwise the caller has to save its registers
+// and call scheduler_run_next.
+int scheduler_can_return(struct process_control_block* pcb)
+{
+    if (pcb != current_process || pcb->status != PROC_RDY || ready_queue_has_higher(pcb) ||
+        !hart_allows(hart_id(), pcb))
+        return 0;
+
+    scheduler_resume_current();
+    stats_charge(pcb, &pcb->stats.kernel_time, read_time());
+    // the ecall might have changed the memory regions of the process
+    pmp_load(pcb);
+    kernel_lock_release();
+    return 1;
 }
 
 // try to return to a process
 void scheduler_try_return_to(struct process_control_block* pcb)
 {
-    // if the process isn't ready, schedule a new one
-    if (pcb->status != PROC_RDY) {
+    // if the process isn't ready, may not run here or a process with a higher
+    // priority became runnable, schedule a new one
+    if (pcb->status != PROC_RDY || ready_queue_has_higher(pcb) || !hart_allows(hart_id(), pcb)) {
         scheduler_run_next();
     } else {
         // if we want to return to the current process...
         if (current_process == pcb) {
             dbgln("returning to process...", 23);
-            // add time spent in ecall handler to the processes time slice
-            next_interrupt_scheduled_for = next_interrupt_scheduled_for + (read_time() - scheduling_interrupted_start);
-            write_mtimecmp(next_interrupt_scheduled_for);
+            scheduler_resume_current();
             scheduler_switch_to(current_process);
         } else {
-            // otherwise set a new interrupt
-            set_next_interrupt();
+            // otherwise switch to it and set a new interrupt
+            ready_queue_remove(pcb);
+            if (current_process != NULL && current_process->status == PROC_RDY) {
+                stats_charge(current_process, &current_process->stats.kernel_time, read_time());
+                current_process->stats.involuntary_switches++;
+                ready_queue_requeue(current_process);
+            }
+            stats_charge(pcb, &pcb->stats.wait_time, read_time());
+            pcb->hart = hart_id();
             current_process = pcb;
+            set_next_interrupt();
             scheduler_switch_to(current_process);
         }
     }
 }
 
+// block the given process until the deadline is reached (or it is woken up
+// earlier). The process status has to be set by the caller.
+void scheduler_set_timeout(struct process_control_block* pcb, uint64 deadline)
+{
+    timer_queue_remove(pcb);
+    pcb->asleep_until = deadline;
+
+    timer_queue_len++;
+    timer_queue_set(timer_queue_len - 1, pcb);
+    timer_queue_sift_up(timer_queue_len - 1);
+}
+
+// append a process to a wait queue, the caller has to set its status
+void wait_queue_add(struct wait_queue* queue, struct process_control_block* pcb)
+{
+    pcb->waiting_on = queue;
+    pcb->wait_next = NULL;
+
+    if (queue->tail != NULL)
+        queue->tail->wait_next = pcb;
+    else
+        queue->head = pcb;
+
+    queue->tail = pcb;
+}
+
+// take the first process out of a wait queue, returns NULL if it is empty
+struct process_control_block* wait_queue_pop(struct wait_queue* queue)
+{
+    struct process_control_block* pcb = queue->head;
+
+    if (pcb != NULL)
+        wait_queue_remove(pcb);
+
+    return pcb;
+}
+
+// unlink a process from the wait queue it is blocked on, if any
+void wait_queue_remove(struct process_control_block* pcb)
+{
+    struct wait_queue* queue = pcb->waiting_on;
+
+    if (queue == NULL)
+        return;
+
+    // find the predecessor, wait queues are short so a scan is fine
+    struct process_control_block* prev = NULL;
+    struct process_control_block* it = queue->head;
+
+    while (it != pcb) {
+        prev = it;
+        it = it->wait_next;
+    }
+
+    if (prev != NULL)
+        prev->wait_next = pcb->wait_next;
+    else
+        queue->head = pcb->wait_next;
+
+    if (queue->tail == pcb)
+        queue->tail = prev;
+
+    pcb->waiting_on = NULL;
+    pcb->wait_next = NULL;
+}
+
+// mark a blocked process as runnable and put it into the ready queue
+void scheduler_wake(struct process_control_block* pcb)
+{
+    wait_queue_remove(pcb);
+    timer_queue_remove(pcb);
+    pcb->status = PROC_RDY;
+    pcb->asleep_until = 0;
+    // it waits from now on, a process that is still running is charged
+    // when it leaves the kernel
+    if (!process_is_running(pcb)) {
+        pcb->stats_mark = read_time();
+        ready_queue_enqueue(pcb);
+    }
+    trace(TRACE_WAKE, pcb->pid, pcb->hart, 0);
+}
+
+// wake up all processes whose sleep or join timeout ran out.
+static void wake_expired_timeouts(uint64 mtime)
+{
+    while (timer_queue_len > 0 && timer_queue[0]->asleep_until <= mtime) {
+        struct process_control_block* pcb = timer_queue[0];
+
+        // if the process was blocked on a wait queue, tell it the timeout ran out
+        if (pcb->waiting_on != NULL) {
+            pcb->regs[REG_A0] = ETIMEOUT;
+            pcb->regs[REG_A0 + 1] = 0;
+        }
+
+        scheduler_wake(pcb);
+    }
+}
+
+// check if any other hart is running a process
+static int other_harts_busy()
+{
+    for (int i = 0; i < HART_COUNT; i++) {
+        if (i != hart_id() && harts[i].current != NULL && !hart_is_idle(&harts[i]))
+            return 1;
+    }
+    return 0;
+}
+
 // select a new process to run next
 struct process_control_block* scheduler_select_free()
 {
-    uint64 mtime;
-    int timeout_available = 0; // note if a timeout is available
+    struct hart_state* hart = this_hart();
 
     while (1) {
-        mtime = read_time();
-        // start at the last scheduled process
-        struct process_control_block* pcb = current_process;
-
-        // iterate once over the whole list
-        do {
-            // get next pcb
-            pcb++;
-            // wrap around the end of the list
-            if (pcb > processes + PROCESS_COUNT)
-                pcb = processes;
-
-            // when we find a process which is ready to be scheduled, return it!
-            if (pcb->status == PROC_RDY)
-                return pcb;
+        wake_expired_timeouts(read_time());
 
-            // if it's sleeping, check if it is time to wake it up
-            if (pcb->status == PROC_WAIT_SLEEP) {
-                if (pcb->asleep_until < mtime) {
-                    pcb->status = PROC_RDY;
-                    return pcb;
-                }
-                timeout_available = 1;
-            }
+        // when we find a process which is ready to be scheduled, return it!
+        // if this hart has nothing to do, take work from another one
+        struct process_control_block* pcb = ready_queue_pop(hart);
+        if (pcb == NULL)
+            pcb = ready_queue_steal(hart);
+        if (pcb != NULL) {
+            pcb->hart = hart_id();
+            return pcb;
+        }
 
-            // if it's waiting for another process, check if the process exited
-            // or if is waiting with a timeout, tell it the timeout expired
-            if (pcb->status == PROC_WAIT_PROC) {
-                if (pcb->waiting_for_process != NULL &&
-                    pcb->waiting_for_process->status == PROC_DEAD) {
-                    // the requested process exited, so we can set the status code and
-                    pcb->regs[REG_A0] = 0;
-                    pcb->regs[REG_A0 + 1] = pcb->waiting_for_process->exit_code;
-                    pcb->status = PROC_RDY;
-                    return pcb;
-                }
-                if (pcb->asleep_until != 0) {
-                    if (pcb->asleep_until < mtime) {
-                        // if the timeout ran out, set an error code
-                        pcb->regs[REG_A0 + 1] = ETIMEOUT;
-                        pcb->status = PROC_RDY;
-                        return pcb;
-                    }
-                    timeout_available = 1;
-                }
-            }
-        } while (pcb != current_process);
+        // isolated harts wait for their pinned processes, the deadlines of
+        // all others are handled by the remaining harts
+        uint64 deadline = hart->isolated ? 0 : timer_queue_next_deadline();
+        int busy = hart->isolated || other_harts_busy();
+
+        // buffered console output is written now that there is time for it
+        console_flush_all();
 
-        // when we finished iterating over all processes and no process can be scheduled we have a problem
-        if (timeout_available == 0) {
+        // when no process can be scheduled we have a problem
+        if (deadline == 0 && !busy) {
             // either process deadlock without timeout or no processes alive.
             //TODO: handle deadlocks by killing a process
             dbgln("No thread active!", 17);
             HALT(22);
         }
+
+        // processes running on other harts can wake up or create new ones,
+        // without inter-processor interrupts we have to look for them
+        if (busy && !IPI_AVAILABLE) {
+            uint64 poll = read_time() + TIME_SLICE_LEN;
+
+            if (deadline == 0 || poll < deadline)
+                deadline = poll;
+        }
+
+        // nothing can run before the next deadline, so wait for it. An
+        // interrupt from another hart ends the idle period earlier.
+        scheduler_idle(deadline == 0 ? ~0ull : deadline);
+    }
+}
+
+// halt the hart until the given deadline. The timer interrupt resumes
+// scheduling in scheduler_handle_timer()
+void scheduler_idle(uint64 deadline)
+{
+    struct hart_state* hart = this_hart();
+
+    trace(TRACE_IDLE, 0, (int) deadline, (int) (deadline >> 32));
+    hart->current = &hart->idle_pcb;
+    hart->idle_start = read_time();
+    write_mtimecmp(deadline);
+    kernel_lock_release();
+    kernel_idle(hart->idle_pcb.regs);
+}
+
+// called from the trap handler when an interrupt ended an idle period
+static void scheduler_leave_idle()
+{
+    struct hart_state* hart = this_hart();
+
+    hart->idle_time += read_time() - hart->idle_start;
+    hart->current = NULL;
+    // the trap came from machine mode, restore the mstatus value set up in
+    // boot.S so mret returns to user mode again
+    CSR_WRITE(CSR_MSTATUS, 0x80);
+}
+
+// returns the total number of time ticks spent idling over all harts
+uint64 scheduler_idle_time()
+{
+    uint64 idle_time = 0;
+
+    for (int i = 0; i < HART_COUNT; i++)
+        idle_time += harts[i].idle_time;
+
+    return idle_time;
+}
+
+static void __attribute__((noreturn)) scheduler_interrupted();
+
+// called on every inter-processor interrupt, another hart queued a process
+// for this one or killed the process running here
+void scheduler_handle_ipi()
+{
+    uint64 now = read_time();
+
+    kernel_lock_acquire();
+    stats_trap_entry(now);
+    clear_ipi();
+    scheduler_interrupted();
+}
+
+// called on every timer interrupt
+void scheduler_handle_timer()
+{
+    uint64 now = read_time();
+
+    kernel_lock_acquire();
+    stats_trap_entry(now);
+    // idle harts are not sampled
+    if (current_process != NULL && !hart_is_idle(this_hart()))
+        profile_timer(now, current_process);
+    scheduler_interrupted();
+}
+
+// decide whether the interrupted process can continue running
+static void scheduler_interrupted()
+{
+    if (hart_is_idle(this_hart()))
+        scheduler_leave_idle();
+
+    uint64 mtime = read_time();
+
+    wake_expired_timeouts(mtime);
+
+    // if the interrupt was for a deadline and the current process still has
+    // time left in its slice, continue running it unless a process with a
+    // higher priority woke up
+    if (current_process != NULL && current_process->status == PROC_RDY &&
+        mtime < next_interrupt_scheduled_for &&
+        !ready_queue_has_higher(current_process) && hart_allows(hart_id(), current_process)) {
+        program_timer_interrupt();
+        scheduler_switch_to(current_process);
     }
+
+    scheduler_run_next();
 }
 
 // performs the context switch from kernel to userspace mode
 void scheduler_switch_to(struct process_control_block* pcb)
 {
+    stats_charge(pcb, &pcb->stats.kernel_time, read_time());
+    trace(TRACE_SWITCH, pcb->pid, pcb->pc, this_hart()->ready_count);
+    // restrict user mode to the memory of this process
+    pmp_load(pcb);
+
     CSR_WRITE(CSR_MEPC, pcb->pc);
 
+    // nothing shared is touched from here on
+    kernel_lock_release();
+
+#ifdef HOST_BUILD
+    // the simulated hart runs pcb until the harness enters the kernel again
+    host_switch_to(pcb);
+#else
     // set up registers
     __asm__ (
          "mv     x31, %0\n"
@@ -166,6 +857,7 @@ void scheduler_switch_to(struct process_control_block* pcb)
          :: "r"(pcb->regs), "I"(CSR_MSCRATCH)
     );
     __builtin_unreachable();
+#endif
 }
 
 // get a PCB from a pid
@@ -189,10 +881,94 @@ struct process_control_block* get_current_process()
 }
 
 // this method sets up the mtimecmp register to trigger the next timer interrupt
+// at the end of the current processes time slice
 void set_next_interrupt()
 {
-    next_interrupt_scheduled_for = read_time() + TIME_SLICE_LEN;
-    write_mtimecmp(next_interrupt_scheduled_for);
+    uint64 slice = scheduler_slice_len(current_process);
+
+    // processes without a time slice are only interrupted for deadlines
+    if (slice == 0)
+        next_interrupt_scheduled_for = ~0ull;
+    else
+        next_interrupt_scheduled_for = read_time() + slice;
+
+    program_timer_interrupt();
+}
+
+// change the scheduling class of a process. For SCHED_FIFO, param is the
+// real-time priority (0 is the highest), for SCHED_FAIR it is the weight.
+int scheduler_set_class(struct process_control_block* pcb, enum sched_class sched_class, int param)
+{
+    if (sched_class == SCHED_FIFO) {
+        if (param < 0 || param >= SCHED_RT_PRIORITIES)
+            return EINVAL;
+    } else if (sched_class == SCHED_FAIR) {
+        if (param < 1 || param > SCHED_MAX_WEIGHT)
+            return EINVAL;
+    } else {
+        return EINVAL;
+    }
+
+    // the ready queue depends on the class, so requeue the process
+    int queued = ready_queue_contains(pcb);
+
+    ready_queue_remove(pcb);
+
+    pcb->sched_class = sched_class;
+    if (sched_class == SCHED_FIFO) {
+        pcb->priority = param;
+    } else {
+        pcb->priority = 0;
+        pcb->weight = param;
+    }
+
+    if (queued)
+        ready_queue_push(pcb);
+
+    return 0;
+}
+
+// restrict the harts a process may run on. Bits for harts that don't exist
+// are ignored, a mask that leaves no hart to run on is rejected.
+int scheduler_set_affinity(struct process_control_block* pcb, unsigned int mask)
+{
+    mask &= AFFINITY_ALL_HARTS;
+
+    int allowed = 0;
+
+    for (int i = 0; i < HART_COUNT; i++) {
+        unsigned int saved = pcb->affinity;
+
+        pcb->affinity = mask;
+        allowed |= hart_allows(i, pcb);
+        pcb->affinity = saved;
+    }
+
+    if (!allowed)
+        return EINVAL;
+
+    pcb->affinity = mask;
+
+    // move a queued process to a hart it may run on
+    if (ready_queue_contains(pcb)) {
+        ready_queue_remove(pcb);
+        ready_queue_enqueue(pcb);
+    }
+
+    // a process running on another hart is moved when that hart is interrupted,
+    // the current process is moved when it leaves the kernel
+    if (process_is_running(pcb) && pcb->hart != hart_id() && !hart_allows(pcb->hart, pcb))
+        send_ipi(pcb->hart);
+
+    return 0;
+}
+
+// copy the counters of a process and the system wide idle time
+void scheduler_get_stats(struct process_control_block* pcb, struct sched_stats* stats)
+{
+    stats->proc = pcb->stats;
+    stats->idle_time = scheduler_idle_time();
+    stats->now = read_time();
 }
 
 void mark_ecall_entry()
@@ -211,19 +987,20 @@ optional_pcbptr find_available_pcb_slot()
     int start_index = index;
     struct process_control_block* pcb = processes + index;
 
-    while (pcb->status != PROC_DEAD) {
+    // a dead process keeps its slot until its memory is released
+    while (pcb->status != PROC_DEAD || pcb->dying) {
         index = (index + 1) % PROCESS_COUNT;
         // if we iterated over the whole list and found nothing, we have no space left!
         if (index == start_index)
             return (optional_pcbptr) { .error = ENOBUFS };
         pcb = processes + index;
     }
-    index++;
+    index = (index + 1) % PROCESS_COUNT;
 
     return (optional_pcbptr) { .value = pcb };
 }
 
-optional_pcbptr create_new_process(loaded_binary* bin)
+optional_pcbptr create_new_process(loaded_binary* bin, int spawner)
 {
     // try to get an unused entry in the processes list
     optional_pcbptr slot_or_err = find_available_pcb_slot();
@@ -235,7 +1012,8 @@ optional_pcbptr create_new_process(loaded_binary* bin)
     }
 
     // allocate stack for the new process
-    optional_voidptr stack_top_or_err = malloc_stack(); // allocate stack
+    size_t stack_size = USER_STACK_SIZE;
+    optional_voidptr stack_top_or_err = malloc_stack(&stack_size);
 
     // if that failed, we also can't create a new process
     if (has_error(stack_top_or_err)) {
@@ -255,20 +1033,39 @@ optional_pcbptr create_new_process(loaded_binary* bin)
     pcb->binary = bin;
     pcb->parent = NULL;
     pcb->asleep_until = 0;
+    pcb->sched_class = SCHED_FAIR;
+    pcb->priority = 0;
+    pcb->weight = SCHED_DEFAULT_WEIGHT;
+    pcb->affinity = AFFINITY_ALL_HARTS;
+    pcb->ring = NULL;
+    pcb->ring_busy = 0;
+    pcb->regions = NULL;
+    pcb->heap = NULL;
+    pcb->heap_brk = 0;
+    pcb->mem_version = 1;
+    pcb->pmp.version = 0;
     pcb->stack_top = stack_top_or_err.value;
+    pcb->stack_size = stack_size;
+    // start accounting, it waits in the ready queue from now on
+    memset(0, &pcb->stats, &pcb->stats + 1);
+    pcb->stats_mark = read_time();
     // zero out registers
     memset(0, pcb->regs, pcb->regs + 31);
     // load stack top into stack pointer register
     pcb->regs[REG_SP] = (int) stack_top_or_err.value;
     // load pid into a0 register
     pcb->regs[REG_A0] = pid;
+    // make it available to the scheduler
+    pcb->hart = hart_id();
+    ready_queue_enqueue(pcb);
+    trace(TRACE_SPAWN, pid, bin->binid, spawner);
 
     dbgln("Created new process!", 20);
 
     return (optional_pcbptr) { .value = pcb };
 }
 
-optional_pcbptr create_new_thread(struct process_control_block* parent, void* entrypoint, void* args)
+optional_pcbptr create_new_thread(struct process_control_block* parent, void* entrypoint, void* args, size_t stack_size)
 {
     // try to get an unused entry in the processes list
     optional_pcbptr slot_or_err = find_available_pcb_slot();
@@ -279,8 +1076,11 @@ optional_pcbptr create_new_thread(struct process_control_block* parent, void* en
         return slot_or_err;
     }
 
-    // allocate stack for the new process
-    optional_voidptr stack_top_or_err = malloc_stack(); // allocate stack
+    // allocate stack for the new thread, zero selects the default size
+    if (stack_size == 0)
+        stack_size = USER_STACK_SIZE;
+
+    optional_voidptr stack_top_or_err = malloc_stack(&stack_size);
 
     // if that failed, we also can't create a new process
     if (has_error(stack_top_or_err)) {
@@ -300,7 +1100,23 @@ optional_pcbptr create_new_thread(struct process_control_block* parent, void* en
     pcb->binary = parent->binary;
     pcb->parent = parent;
     pcb->asleep_until = 0;
+    // threads inherit the scheduling class of their parent
+    pcb->sched_class = parent->sched_class;
+    pcb->priority = parent->priority;
+    pcb->weight = parent->weight;
+    pcb->affinity = parent->affinity;
+    pcb->ring = NULL;
+    pcb->ring_busy = 0;
+    pcb->regions = NULL;
+    pcb->heap = NULL;
+    pcb->heap_brk = 0;
+    pcb->mem_version = 1;
+    pcb->pmp.version = 0;
     pcb->stack_top = stack_top_or_err.value;
+    pcb->stack_size = stack_size;
+    // start accounting, it waits in the ready queue from now on
+    memset(0, &pcb->stats, &pcb->stats + 1);
+    pcb->stats_mark = read_time();
     // zero out registers
     memset(0, pcb->regs, pcb->regs + 31);
     // set return address to global thread finalizer
@@ -311,6 +1127,10 @@ optional_pcbptr create_new_thread(struct process_control_block* parent, void* en
     pcb->regs[REG_GP] = parent->regs[REG_GP];
     // load args pointer into a0 register
     pcb->regs[REG_A0] = (int) args;
+    // make it available to the scheduler, preferably on another hart
+    pcb->hart = hart_id();
+    ready_queue_enqueue(pcb);
+    trace(TRACE_SPAWN, pid, 0, parent->pid);
 
     dbgln("Created new thread!", 19);
 
@@ -325,18 +1145,72 @@ void kill_child_processes(struct process_control_block* pcb)
         if (proc->parent != pcb || proc->status == PROC_DEAD)
             continue;
 
-        proc->status = PROC_DEAD;
         proc->exit_code = -9;   // set arbitrary exit code
-        kill_child_processes(proc);
+        destroy_process(proc);
+    }
+}
+
+// free the stack of a dead process, and the regions and binary if it is the
+// root of a binary instance
+static void release_process(struct process_control_block* pcb)
+{
+    free_stack(pcb->stack_top, pcb->stack_size);
+    malloc_free_process_memory(pcb);
+    // threads share the binary of their process
+    if (pcb->parent == NULL)
+        loader_release(pcb->binary);
+    else
+        pcb->parent->dying_children--;
+    pcb->dying = 0;
+}
+
+// free the memory of a dead process if no hart executes it anymore. Threads
+// use the memory of their root process, and their parent links have to stay
+// valid, so a process is only released after all processes it started. The
+// parents are released as well when pcb was the last one holding them back.
+static void release_dead_process(struct process_control_block* pcb)
+{
+    while (pcb != NULL && pcb->dying && !process_is_running(pcb) && pcb->dying_children == 0) {
+        struct process_control_block* parent = pcb->parent;
+
+        release_process(pcb);
+        pcb = parent;
     }
 }
 
+// a process killed while it runs on another hart keeps its memory until that
+// hart leaves it, in kernel_enter or when the interrupt sent here arrives.
+// Without IPI_MEM_ADDR that is the next trap of the process, a SCHED_FIFO
+// process that never traps keeps its memory until then.
 void destroy_process(struct process_control_block* pcb)
 {
+    trace(TRACE_EXIT, pcb->pid, pcb->exit_code, 0);
     // kill child processes
     kill_child_processes(pcb);
-    // free allocated stack
-    free_stack(pcb->stack_top);
-    // make sure the thread is not rescheduled
+    console_flush(pcb, 1);
+    chan_release_process(pcb);
+    // make sure the thread is not rescheduled, its memory is freed below or
+    // once no hart executes it anymore
     pcb->status = PROC_DEAD;
+    pcb->dying = 1;
+    if (pcb->parent != NULL)
+        pcb->parent->dying_children++;
+    ready_queue_remove(pcb);
+    // stop it if it is running on another hart
+    if (pcb->hart != hart_id() && process_is_running(pcb))
+        send_ipi(pcb->hart);
+    timer_queue_remove(pcb);
+    wait_queue_remove(pcb);
+    pcb->futex_addr = NULL;
+
+    // processes joining this one can continue now, they receive the exit code
+    struct process_control_block* joiner;
+
+    while ((joiner = wait_queue_pop(&pcb->joiners)) != NULL) {
+        joiner->regs[REG_A0] = 0;
+        joiner->regs[REG_A0 + 1] = pcb->exit_code;
+        scheduler_wake(joiner);
+    }
+
+    release_dead_process(pcb);
 }
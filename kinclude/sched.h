@@ -9,19 +9,40 @@ extern struct process_control_block processes[PROCESS_COUNT];
 
 // scheduler methods
 void scheudler_init();
+void __attribute__((noreturn)) scheduler_start();
 struct process_control_block* scheduler_select_free();
 void set_next_interrupt();
 void __attribute__((noreturn)) scheduler_run_next();
 void __attribute__((noreturn)) scheduler_try_return_to(struct process_control_block*);
+int scheduler_can_return(struct process_control_block*);
 void __attribute__((noreturn)) scheduler_switch_to(struct process_control_block*);
 struct process_control_block* process_from_pid(int pid);
 int* get_current_process_registers();
 struct process_control_block* get_current_process();
 void mark_ecall_entry();
+void scheduler_wake(struct process_control_block* pcb);
+void scheduler_set_timeout(struct process_control_block* pcb, uint64 deadline);
+void __attribute__((noreturn)) scheduler_handle_timer();
+void __attribute__((noreturn)) scheduler_handle_ipi();
+void __attribute__((noreturn)) scheduler_idle(uint64 deadline);
+uint64 scheduler_idle_time();
+void scheduler_get_stats(struct process_control_block* pcb, struct sched_stats* stats);
+int scheduler_set_class(struct process_control_block* pcb, enum sched_class sched_class, int param);
+int scheduler_set_affinity(struct process_control_block* pcb, unsigned int mask);
+
+// the kernel lock, only one hart executes kernel code at a time
+void kernel_lock_acquire();
+void kernel_lock_release();
+void kernel_enter();
+
+// wait queues
+void wait_queue_add(struct wait_queue* queue, struct process_control_block* pcb);
+void wait_queue_remove(struct process_control_block* pcb);
+struct process_control_block* wait_queue_pop(struct wait_queue* queue);
 
 // process creation / destruction
-optional_pcbptr create_new_process(loaded_binary*);
-optional_pcbptr create_new_thread(struct process_control_block*, void*, void*);
+optional_pcbptr create_new_process(loaded_binary*, int);
+optional_pcbptr create_new_thread(struct process_control_block*, void*, void*, size_t);
 void destroy_process(struct process_control_block* pcb);
 void kill_child_processes(struct process_control_block* pcb);
 #endif
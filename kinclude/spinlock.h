@@ -0,0 +1,41 @@
+#ifndef H_SPINLOCK
+#define H_SPINLOCK
+
+#include "../kernel.h"
+
+// a spinlock is a word which is 1 while the lock is held. Locking uses
+// amoswap, on a single hart the functions do nothing. The host build uses the
+// compiler builtins instead.
+typedef volatile int spinlock;
+
+static inline void spin_lock(spinlock* lock)
+{
+#if HART_COUNT > 1 && defined(HOST_BUILD)
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) != 0) ;
+#elif HART_COUNT > 1
+    int old;
+
+    do {
+        // wait until the lock looks free before trying to take it, so waiting
+        // harts only read the lock word
+        while (*lock != 0) ;
+
+        __asm__ volatile ("amoswap.w.aq %0, %1, (%2)" : "=r"(old) : "r"(1), "r"(lock) : "memory");
+    } while (old != 0);
+#else
+    (void) lock;
+#endif
+}
+
+static inline void spin_unlock(spinlock* lock)
+{
+#if HART_COUNT > 1 && defined(HOST_BUILD)
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+#elif HART_COUNT > 1
+    __asm__ volatile ("amoswap.w.rl zero, zero, (%0)" :: "r"(lock) : "memory");
+#else
+    (void) lock;
+#endif
+}
+
+#endif
@@ -0,0 +1,33 @@
+#include "trace.h"
+#include "csr.h"
+
+// records end up in a ring in kernel memory, user mode can't reach it. Dump
+// the memory and decode it with trace.py, it finds the ring through the
+// trace_ring symbol in the debug info written by package.py.
+
+#ifdef TRACE_ENTRIES
+
+struct trace_ring trace_ring = { .entries = TRACE_ENTRIES };
+
+void trace(enum trace_event event, int pid, int arg0, int arg1)
+{
+    struct trace_record* record = &trace_ring.records[trace_ring.head & (TRACE_ENTRIES - 1)];
+
+    record->time = read_time();
+    record->event = event;
+    record->hart = hart_id();
+    record->pid = pid;
+    record->args[0] = arg0;
+    record->args[1] = arg1;
+
+    // publish the record only after it is complete
+    __asm__ volatile ("" ::: "memory");
+    trace_ring.head++;
+}
+
+#else
+
+// this is included to prevent "error: ISO C forbids an empty translation unit [-Wpedantic]"
+typedef int make_iso_compilers_happy;
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef H_TRACE
+#define H_TRACE
+
+#include "../kernel.h"
+#include "ktypes.h"
+
+// event ids, keep in sync with trace.py
+enum trace_event {
+    TRACE_SWITCH        = 1,    // pid starts running, args: pc, processes queued on the hart
+    TRACE_IDLE          = 2,    // the hart goes idle, args: lower and upper deadline bits
+    TRACE_ECALL_ENTER   = 3,    // args: ecall code, a0
+    TRACE_ECALL_EXIT    = 4,    // args: error, value
+    TRACE_WAKE          = 5,    // pid becomes runnable, args: hart it is queued on
+    TRACE_SPAWN         = 6,    // pid was created, args: binid or 0 for threads, parent
+                                //   pid (the spawner for processes, 0 at boot)
+    TRACE_EXIT          = 7,    // pid was destroyed, args: exit code
+    TRACE_ALLOC         = 8,    // args: address, size
+    TRACE_FREE          = 9,    // args: address, size
+};
+
+// if tracing is enabled
+#ifdef TRACE_ENTRIES
+
+#if (TRACE_ENTRIES & (TRACE_ENTRIES - 1)) != 0
+#error "TRACE_ENTRIES has to be a power of two!"
+#endif
+
+// a fixed size trace record, the layout is decoded by trace.py
+struct trace_record {
+    uint64 time;
+    unsigned short event;
+    unsigned short hart;
+    int pid;
+    int args[2];
+};
+
+// records are written under the kernel lock, so there is only one producer.
+// head counts all records ever written, the oldest ones are overwritten.
+struct trace_ring {
+    volatile unsigned int head;
+    unsigned int entries;
+    struct trace_record records[TRACE_ENTRIES];
+};
+
+void trace(enum trace_event event, int pid, int arg0, int arg1);
+
+// without tracing, the calls disappear. The arguments are still evaluated
+// as void, so values only computed for the trace don't count as unused.
+#else
+
+#define trace(event, pid, arg0, arg1) \
+    ((void) (event), (void) (pid), (void) (arg0), (void) (arg1))
+
+#endif
+#endif
@@ -2,11 +2,14 @@
 from dataclasses import dataclass
 from elftools.elf.elffile import ELFFile
 from elftools.elf.sections import Section, SymbolTableSection
+from elftools.elf.relocation import RelocationSection
 from typing import List, Tuple, Dict, Generator, Union, Set
 from collections import defaultdict
 
 import os, sys
 import json
+import struct
+import hashlib
 
 ## Configuration:
 # sector size of the img file in bytes
@@ -15,14 +18,34 @@ SECTOR_SIZE = 512
 # start address
 MEM_START = 0x100
 
-# address where the userspace binaries should be located  (-1 to start directly after the kernel)
+# address where the segments of the userspace binaries should be stored (-1 to start directly after the kernel)
 USR_BIN_START = -1
 
+# compress the segments of the user binaries with lz4, the kernel expands them
+# at boot
+COMPRESS_SEGMENTS = True
+
+# write the user binaries to a disk image <output path>.disk instead of the
+# memory image, the kernel loads them from its block device when they are
+# started (build it with BLOCK_DEVICE_ADDR set)
+DISK_IMAGE = False
+
+# block size of the disk, has to match BLOCK_SIZE in kinclude/blkdev.h
+DISK_BLOCK_SIZE = 512
+
+# number of binaries on the disk that are started at boot (-1 for all of them)
+DISK_AUTOSTART = -1
+
+# complain about user binaries without relocations. Link them with
+# -Wl,--emit-relocs, otherwise absolute addresses in their data are not
+# adjusted when the kernel loads them.
+WARN_MISSING_RELOCS = True
+
 ## end of config
 
 # A set of sections that we want to include in the image
 INCLUDE_THESE_SECTIONS = set((
-    '.text', '.stack', '.bss', '.sdata', '.rdata', '.rodata'
+    '.text', '.stack', '.bss', '.sdata', '.rdata', '.rodata',
     '.sbss', '.data', '.stack', '.init',
     '.fini', '.preinit_array', '.init_array',
     '.fini_array', '.rodata', '.thread_fini'
@@ -32,17 +55,105 @@ EMPTY_SECTIONS = set((
     '.bss', '.sbss', '.stack'
 ))
 
-# this is the name of the global variable holding the list of loaded binaries
+# this is the name of the global variable holding the list of packaged binaries
 KERNEL_BINARY_TABLE = 'binary_table'
-# loaded_binary struct size (4 integers)
-KERNEL_BINARY_TABLE_ENTRY_SIZE = 4 * 4
-
-# overwrite this function to generate the entries for the loaded binary list
-def create_loaded_bin_struct(binid: int, entrypoint: int, start: int, end: int):
+# packaged_binary struct size (8 integers)
+KERNEL_BINARY_TABLE_ENTRY_SIZE = 8 * 4
+# this is the name of the global variable holding the end of the image
+KERNEL_IMAGE_END = 'image_end'
+# this is the name of the global variable describing the compressed segments
+KERNEL_PACKED_IMAGE = 'packed_image'
+
+# struct image_segment: offset, length, source
+IMAGE_SEGMENT = struct.Struct('<III')
+# struct packed_image: source, length, dest, size
+PACKED_IMAGE = struct.Struct('<IIII')
+
+# disk directory, see kinclude/loader.h
+DISK_MAGIC = 0x4b424d45
+DISK_VERSION = 1
+DISK_FLAG_AUTOSTART = 1
+# struct disk_header: magic, version, count, dir_blocks
+DISK_HEADER = struct.Struct('<IIII')
+# struct disk_entry: binid, entrypoint, size, link_base, segment_count,
+# reloc_count, flags, block, length
+DISK_ENTRY = struct.Struct('<iIIIIIIII')
+
+# segment kinds, a word that belongs to several sections gets the highest kind
+SEG_ZERO = 0
+SEG_RO = 1
+SEG_RW = 2
+
+SHF_WRITE = 0x1
+
+# relocation types, all others are pc-relative or only guide the linker
+R_RISCV_32 = 1
+# absolute addresses in instructions, code using them can't be moved
+R_RISCV_ABSOLUTE_CODE = set((26, 27, 28)) # HI20, LO12_I, LO12_S
+
+# overwrite this function to generate the entries for the packaged binary list
+def create_packaged_bin_struct(binid: int, entrypoint: int, size: int, link_base: int,
+                               segment_count: int, segments: int, reloc_count: int, relocs: int):
     """
     Creates the binary data to populate the KERNEL_BINARY_TABLE structs
     """
-    return b''.join(num.to_bytes(4, 'little') for num in (binid, entrypoint, start, end))
+    return b''.join(num.to_bytes(4, 'little') for num in (
+        binid, entrypoint, size, link_base, segment_count, segments, reloc_count, relocs
+    ))
+
+
+def align_up(val: int, bound: int) -> int:
+    return (val + bound - 1) // bound * bound
+
+
+def lz4_compress(data: bytes) -> bytes:
+    """
+    compress data into a single lz4 block (no frame), as expanded by
+    kinclude/lz4.c. Matches are found greedily through a table of the last
+    position of every four byte sequence.
+    """
+    def put_length(out: bytearray, length: int):
+        while length >= 255:
+            out.append(255)
+            length -= 255
+        out.append(length)
+
+    def put_sequence(out: bytearray, literals: bytes, offset: int = 0, match: int = 0):
+        token = min(len(literals), 15) << 4
+        if offset:
+            token |= min(match - 4, 15)
+        out.append(token)
+        if len(literals) >= 15:
+            put_length(out, len(literals) - 15)
+        out += literals
+        if offset:
+            out += offset.to_bytes(2, 'little')
+            if match - 4 >= 15:
+                put_length(out, match - 19)
+
+    out = bytearray()
+    last_pos = dict()
+    anchor = 0
+    pos = 0
+    # the format requires the last match to start 12 bytes before the end
+    # and the last 5 bytes to be literals
+    match_limit = len(data) - 12
+    while pos < match_limit:
+        key = data[pos : pos + 4]
+        candidate = last_pos.get(key)
+        last_pos[key] = pos
+        if candidate is None or pos - candidate > 0xffff:
+            pos += 1
+            continue
+        length = 4
+        max_length = len(data) - 5 - pos
+        while length < max_length and data[candidate + length] == data[pos + length]:
+            length += 1
+        put_sequence(out, data[anchor:pos], pos - candidate, length)
+        pos += length
+        anchor = pos
+    put_sequence(out, data[anchor:])
+    return bytes(out)
 
 
 def overlaps(p1, l1, p2, l2) -> bool:
@@ -70,12 +181,15 @@ class MemoryImageDebugInfos:
 
     sections: Dict[str, Dict[str, Tuple[int, int]]]
     """
-    This dictionary maps a program and section to (start address, section length)
+    This dictionary maps a program and section to (start address, section length).
+    User binaries are built at load time, their addresses are offsets into an
+    instance of the binary.
     """
 
     symbols: Dict[str, Dict[str, int]]
     """
-    This dictionary maps a program and a symbol to a value
+    This dictionary maps a program and a symbol to a value, which is an offset
+    into an instance for user binaries
     """
 
     globals: Dict[str, Set[str]]
@@ -151,11 +265,15 @@ class Section:
     start: int
     size: int
     data: bytes
+    empty: bool
+    writable: bool
 
     def __init__(self, sec):
         self.name = sec.name
         self.start = sec.header.sh_addr
-        if sec.name not in EMPTY_SECTIONS:
+        self.empty = sec.name in EMPTY_SECTIONS
+        self.writable = (sec.header.sh_flags & SHF_WRITE) != 0
+        if not self.empty:
             self.data = sec.data()
         else:
             self.data = bytes(sec.header.sh_size)
@@ -173,14 +291,21 @@ class Bin:
     secs: List[Section]
     symtab: Dict[str, int]
     global_symbols: List[str]
+    relocs: List[int]
+    has_relocs: bool
+    absolute_code_relocs: int
     entry: int
     start: int
+    end: int
 
     def __init__(self, name):
         self.name = name
         self.secs = list()
         self.symtab = dict()
         self.global_symbols = list()
+        self.relocs = list()
+        self.has_relocs = False
+        self.absolute_code_relocs = 0
 
         with open(self.name, 'rb') as f:
             elf = ELFFile(f)
@@ -201,9 +326,29 @@ class Bin:
 
                         if sym.entry.st_info.bind == 'STB_GLOBAL':
                             self.global_symbols.append(sym.name)
+                if isinstance(sec, RelocationSection):
+                    self.read_relocs(elf, sec)
 
             self.secs = sorted(self.secs, key=lambda sec: sec.start)
             self.start = self.secs[0].start
+            self.end = max(sec.start + sec.size for sec in self.secs)
+
+    def read_relocs(self, elf: ELFFile, sec: RelocationSection):
+        """
+        collect the addresses of words holding absolute addresses, they are
+        only available if the binary was linked with --emit-relocs
+        """
+        target = elf.get_section(sec.header.sh_info)
+        if target.name not in INCLUDE_THESE_SECTIONS:
+            return
+        self.has_relocs = True
+        for rel in sec.iter_relocations():
+            if rel.entry.r_info_type == R_RISCV_32:
+                if rel.entry.r_offset % 4 != 0:
+                    raise Exception("unaligned relocation at {:x} in {}".format(rel.entry.r_offset, self.name))
+                self.relocs.append(rel.entry.r_offset)
+            elif rel.entry.r_info_type in R_RISCV_ABSOLUTE_CODE:
+                self.absolute_code_relocs += 1
 
     def __iter__(self):
         for x in self.secs:
@@ -212,17 +357,51 @@ class Bin:
     def size(self):
         return sum(sec.size for sec in self)
 
+    def segments(self) -> List[Tuple[int, int, bytes]]:
+        """
+        split the memory of an instance into segments of (kind, offset, data).
+        Segments are word aligned, zero segments are only described.
+        """
+        size = align_up(self.end - self.start, 8)
+        mem = bytearray(size)
+        kinds = [SEG_ZERO] * (size // 4)
+
+        for sec in self:
+            if sec.empty or sec.size == 0:
+                continue
+            offset = sec.start - self.start
+            mem[offset : offset + sec.size] = sec.data
+            kind = SEG_RW if sec.writable else SEG_RO
+            for word in range(offset // 4, align_up(offset + sec.size, 4) // 4):
+                kinds[word] = max(kinds[word], kind)
+
+        segments = list()
+        first = 0
+        for word in range(1, len(kinds) + 1):
+            if word == len(kinds) or kinds[word] != kinds[first]:
+                segments.append((kinds[first], first * 4, bytes(mem[first * 4 : word * 4])))
+                first = word
+        return segments
+
 class MemImageCreator:
     """
     Interface for writing the img file
     """
     data: bytes
     patches: List[Tuple[int, bytes]]
+    blobs: Dict[bytes, int]
+    compress: bool
+    packed: bytearray
+    packed_refs: List[Tuple[int, int]]
     dbg_nfo: MemoryImageDebugInfos
 
-    def __init__(self):
+    def __init__(self, compress: bool = False):
         self.data = b''
         self.patches = list()
+        self.blobs = dict()
+        self.compress = compress
+        self.packed = bytearray()
+        self.packed_refs = list()
         self.dbg_nfo = MemoryImageDebugInfos.builder()
 
     def seek(self, pos):
@@ -261,6 +440,82 @@ class MemImageCreator:
         self.dbg_nfo.globals[bin.name] = set(bin.global_symbols)
         return bin_start
 
+    def putBlob(self, stuff: bytes) -> Tuple[int, bool]:
+        """
+        store read-only data in the image, data with the same contents is
+        only stored once. Returns the position and if it was already stored.
+        When compressing, the position is an offset into the packed segments.
+        """
+        key = hashlib.sha256(stuff).digest()
+        if key in self.blobs:
+            return self.blobs[key], True
+        if self.compress:
+            pos = align_up(len(self.packed), 4)
+            self.packed += bytes(pos - len(self.packed)) + stuff
+        else:
+            self.align(4)
+            pos = self.put(stuff, '', '.segment')
+        self.blobs[key] = pos
+        return pos, False
+
+    def putPackedSegments(self) -> Tuple[int, int, int, int]:
+        """
+        store the packed segments as one lz4 block, they are expanded to the
+        memory after the image at boot. Returns the struct packed_image fields.
+        """
+        self.align(4)
+        stream = lz4_compress(bytes(self.packed))
+        source = self.put(stream, '', '.packed')
+        self.align(8)
+        dest = len(self.data)
+        # point the segment tables to where the segments are expanded to
+        for pos, offset in self.packed_refs:
+            self.patch(pos, (dest + offset).to_bytes(4, 'little'))
+        return source, len(stream), dest, len(self.packed)
+
+    def putPackagedBin(self, bin: Bin) -> Tuple[int, int, int, int]:
+        """
+        store the segments and relocations of a user binary, returns the
+        position and length of the segment table and relocation table
+        """
+        segments = b''
+        packed = list()
+        for kind, offset, data in bin.segments():
+            if kind == SEG_ZERO:
+                source = 0
+                print(f"  - zeros   {offset:>6x}:{offset + len(data):<6x}")
+            else:
+                source, shared = self.putBlob(data)
+                print(f"  - {'rw' if kind == SEG_RW else 'ro'}      {offset:>6x}:{offset + len(data):<6x} at {'+' if self.compress else ''}{source:x}{' (shared)' if shared else ''}")
+                if self.compress:
+                    packed.append((len(segments) + 8, source))
+            segments += IMAGE_SEGMENT.pack(offset, len(data), source)
+
+        self.align(4)
+        seg_table = self.put(segments, '', '.segments')
+        self.packed_refs += [(seg_table + pos, source) for pos, source in packed]
+
+        relocs = b''.join((addr - bin.start).to_bytes(4, 'little') for addr in sorted(bin.relocs))
+        reloc_table = self.put(relocs, '', '.relocs') if relocs else 0
+        print(f"  - {len(bin.relocs)} relocations")
+
+        self.putBinDebugInfo(bin)
+        return seg_table, len(segments) // IMAGE_SEGMENT.size, reloc_table, len(bin.relocs)
+
+    def putBinDebugInfo(self, bin: Bin):
+        """
+        add the sections and symbols of a user binary, as offsets into an
+        instance of it
+        """
+        for sec in bin:
+            self.dbg_nfo.sections[bin.name][sec.name] = (sec.start - bin.start, sec.size)
+        self.dbg_nfo.symbols[bin.name] = {
+            name: val - bin.start
+            for name, val in sorted(bin.symtab.items(), key=lambda x:x[1])
+            if val != 0
+        }
+        self.dbg_nfo.globals[bin.name] = set(bin.global_symbols)
+
     def patch(self, pos, bytes):
         for ppos, pbytes in self.patches:
             if overlaps(ppos, len(pbytes), pos, len(bytes)):
@@ -296,17 +551,92 @@ class MemImageCreator:
             f.write(self.dbg_nfo.serialize())
 
 
+class DiskImageCreator:
+    """
+    Interface for writing the disk image. The disk starts with a directory of
+    the binaries, followed by one block aligned record per binary. The kernel
+    reads a record when the binary is started.
+    """
+    entries: List[Tuple[int, Bin, int, int, int, int]]
+    records: bytes
+    stored: Dict[bytes, Tuple[int, int]]
+
+    def __init__(self):
+        self.entries = list()
+        self.records = b''
+        self.stored = dict()
+
+    def putBin(self, binid: int, bin: Bin, flags: int):
+        """
+        store the record of a binary: its segment table, relocation table and
+        segment contents. Sources are offsets into the record, identical
+        segments and identical records are stored once.
+        """
+        segments = bin.segments()
+        relocs = b''.join((addr - bin.start).to_bytes(4, 'little') for addr in sorted(bin.relocs))
+        contents_start = len(segments) * IMAGE_SEGMENT.size + len(relocs)
+
+        table = b''
+        contents = b''
+        blobs: Dict[bytes, int] = dict()
+        for kind, offset, data in segments:
+            source = 0
+            if kind != SEG_ZERO:
+                key = hashlib.sha256(data).digest()
+                if key not in blobs:
+                    blobs[key] = contents_start + len(contents)
+                    contents += data
+                source = blobs[key]
+            table += IMAGE_SEGMENT.pack(offset, len(data), source)
+
+        record = table + relocs + contents
+        key = hashlib.sha256(record).digest()
+        if key in self.stored:
+            block, _ = self.stored[key]
+            print(f"  - record of {len(record):x} bytes (shared)")
+        else:
+            block = len(self.records) // DISK_BLOCK_SIZE
+            self.records += record + bytes(align_up(len(record), DISK_BLOCK_SIZE) - len(record))
+            self.stored[key] = (block, len(record))
+            print(f"  - record of {len(record):x} bytes at block {block}")
+
+        self.entries.append((binid, bin, flags, len(segments), block, len(record)))
+
+    def write(self, fname):
+        """
+        write to a file, the records follow the directory
+        """
+        dir_blocks = align_up(DISK_HEADER.size + len(self.entries) * DISK_ENTRY.size, DISK_BLOCK_SIZE) // DISK_BLOCK_SIZE
+        directory = DISK_HEADER.pack(DISK_MAGIC, DISK_VERSION, len(self.entries), dir_blocks)
+        for binid, bin, flags, seg_count, block, length in self.entries:
+            directory += DISK_ENTRY.pack(
+                binid, bin.entry - bin.start, align_up(bin.end - bin.start, 8), bin.start,
+                seg_count, len(bin.relocs), flags, dir_blocks + block, length
+            )
+        directory += bytes(dir_blocks * DISK_BLOCK_SIZE - len(directory))
+
+        print(f"writing disk image to {fname}")
+        print(f" - directory {len(self.entries)} binaries in {dir_blocks} blocks")
+        print(f" - records   {len(self.records) // DISK_BLOCK_SIZE} blocks")
+        with open(fname, 'wb') as f:
+            f.write(directory)
+            f.write(self.records)
+
+
 def package(kernel: str, binaries: List[str], out: str):
     """
     Main logic for creating the image file
     """
-    img = MemImageCreator()
+    img = MemImageCreator(COMPRESS_SEGMENTS and not DISK_IMAGE)
+    disk = DiskImageCreator() if DISK_IMAGE else None
 
     # process kernel
     img.seek(MEM_START)
     kernel = Bin(kernel)
     kernel.name = 'kernel' # make sure kernel is marked kernel in debug symbols
     bin_table_addr = kernel.symtab.get(KERNEL_BINARY_TABLE, 0) - kernel.start + MEM_START
+    image_end_addr = kernel.symtab.get(KERNEL_IMAGE_END, 0) - kernel.start + MEM_START
+    packed_image_addr = kernel.symtab.get(KERNEL_PACKED_IMAGE, 0) - kernel.start + MEM_START
     print(f"kernel binary loaded, binary table located at: {bin_table_addr:x} (symtab addr {kernel.symtab.get(KERNEL_BINARY_TABLE, '??'):x})")
 
 
@@ -316,26 +646,54 @@ def package(kernel: str, binaries: List[str], out: str):
         img.seek(USR_BIN_START)
 
     binid = 0
+    mem_size = 0
+    stored_start = len(img.data)
     for bin_name in binaries:
-        img.align(8) # align to eight bytes
         bin = Bin(bin_name)
         print(f"adding binary \"{bin.name}\"")
-        start = img.putBin(bin)
-        addr = bin_table_addr + (binid * KERNEL_BINARY_TABLE_ENTRY_SIZE)
-        img.patch(addr, create_loaded_bin_struct(binid+1, bin.entry - bin.start + start, start, start + bin.size()))
+        if WARN_MISSING_RELOCS and not bin.has_relocs:
+            print(f"  warning: no relocations, link with -Wl,--emit-relocs")
+        if bin.absolute_code_relocs:
+            print(f"  warning: {bin.absolute_code_relocs} absolute addresses in code, compile with -mcmodel=medany")
+        size = align_up(bin.end - bin.start, 8)
+        if disk is not None:
+            autostart = DISK_AUTOSTART < 0 or binid < DISK_AUTOSTART
+            disk.putBin(binid+1, bin, DISK_FLAG_AUTOSTART if autostart else 0)
+            img.putBinDebugInfo(bin)
+        else:
+            seg_table, seg_count, reloc_table, reloc_count = img.putPackagedBin(bin)
+            addr = bin_table_addr + (binid * KERNEL_BINARY_TABLE_ENTRY_SIZE)
+            img.patch(addr, create_packaged_bin_struct(
+                binid+1, bin.entry - bin.start, size, bin.start,
+                seg_count, seg_table, reloc_count, reloc_table
+            ))
         binid += 1
-        print(f"           binary    image")
-        print(f"  entry:   {bin.entry:>6x}   {bin.entry - bin.start + start:>6x}")
-        print(f"  start:   {bin.start:>6x}   {start:>6x}")
+        mem_size += size
+        print(f"  entry:   {bin.entry - bin.start:>6x}")
+        print(f"  size:    {size:>6x}")
+
+    image_end = len(img.data)
+    if img.packed:
+        source, length, dest, size = img.putPackedSegments()
+        img.patch(packed_image_addr, PACKED_IMAGE.pack(source, length, dest, size))
+        image_end = dest + size
+        print(f"compressed {size:x} bytes of segments to {length:x} bytes, expanded to {dest:x}:{dest + size:x} at boot")
+
+    img.align(8)
+    img.patch(image_end_addr, align_up(image_end, 8).to_bytes(4, 'little'))
+    print(f"stored {len(img.data) - stored_start:x} bytes for {mem_size:x} bytes of binaries")
 
     img.write(out)
+    if disk is not None:
+        disk.write(out + '.disk')
 
 
 if __name__ == '__main__':
     if '--help' in sys.argv or len(sys.argv) == 1:
         print("package.py <kernel path> <user path> [<user path>...] <output path>\n\
 \n\
-Generate a memory image with the given kernel and userspace binaries.")
+Generate a memory image with the given kernel and userspace binaries. With\n\
+DISK_IMAGE set, the binaries are written to <output path>.disk instead.")
     else:
         print(f"creating image {sys.argv[-1]}")
         package(sys.argv[1], sys.argv[2:-1], sys.argv[-1])
@@ -0,0 +1,132 @@
+#!/usr/bin/env python3
+from typing import List, Dict, Tuple, Optional
+from collections import Counter, defaultdict
+from bisect import bisect_right
+
+import sys
+import json
+import struct
+
+## Configuration:
+# name of the kernel symbol holding the sample buffer
+KERNEL_PROFILE_BUFFER = 'profile_buffer'
+
+# number of functions listed in the flat profile of each binary
+FLAT_PROFILE_LINES = 20
+
+## end of config
+
+# struct profile_buffer header: count, dropped, capacity, interval
+BUFFER_HEADER = struct.Struct('<IIII')
+# struct profile_sample: pid, binid, hart, pc, ra
+SAMPLE = struct.Struct('<iHHII')
+
+
+class BinarySymbols:
+    """
+    Resolves offsets into a binary to function names, using the symbols of
+    the binary in the debug info written by package.py
+    """
+    name: str
+    start: int
+    addrs: List[int]
+    names: List[str]
+
+    def __init__(self, name: str, sections: Dict[str, Tuple[int, int]], symbols: Dict[str, int]):
+        self.name = name
+        self.start = min(start for start, _ in sections.values())
+        entries = sorted((addr, sym) for sym, addr in symbols.items())
+        self.addrs = [addr for addr, _ in entries]
+        self.names = [sym for _, sym in entries]
+
+    def resolve(self, offset: int) -> Optional[str]:
+        i = bisect_right(self.addrs, self.start + offset) - 1
+        if i < 0:
+            return None
+        return self.names[i]
+
+
+def load_binaries(dbg: dict) -> Dict[int, BinarySymbols]:
+    # binary ids are assigned in the order package.py added the binaries
+    names = [name for name in dbg['symbols'] if name != 'kernel']
+    return {
+        binid + 1: BinarySymbols(name, dbg['sections'][name], dbg['symbols'][name])
+        for binid, name in enumerate(names)
+    }
+
+
+def read_samples(dump: bytes, buffer_addr: int) -> Tuple[List[tuple], int, int]:
+    """
+    returns the samples, the number of dropped samples and the interval
+    """
+    count, dropped, capacity, interval = BUFFER_HEADER.unpack_from(dump, buffer_addr)
+    samples_addr = buffer_addr + BUFFER_HEADER.size
+    samples = [
+        SAMPLE.unpack_from(dump, samples_addr + i * SAMPLE.size)
+        for i in range(min(count, capacity))
+    ]
+    return samples, dropped, interval
+
+
+def profile(dump_path: str, dbg_path: str, out_prefix: str):
+    """
+    print a flat profile of every binary and write folded stacks for
+    flamegraph.pl or speedscope to <out_prefix>.<binary>.folded
+    """
+    with open(dbg_path, 'r') as f:
+        dbg = json.load(f)
+
+    with open(dump_path, 'rb') as f:
+        dump = f.read()
+
+    buffer_addr = dbg.get('base', 0) + dbg['symbols']['kernel'][KERNEL_PROFILE_BUFFER]
+    samples, dropped, interval = read_samples(dump, buffer_addr)
+    binaries = load_binaries(dbg)
+
+    print(f"{len(samples)} samples taken every {interval} ticks, {dropped} dropped")
+
+    flat: Dict[str, Counter] = defaultdict(Counter)
+    folded: Dict[str, Counter] = defaultdict(Counter)
+
+    for pid, binid, hart, pc, ra in samples:
+        syms = binaries.get(binid)
+        if syms is None:
+            continue
+        func = syms.resolve(pc) or hex(pc)
+        flat[syms.name][func] += 1
+
+        # the return address is only the caller in leaf functions, or before
+        # the first call of a function. Otherwise it points into the function
+        # itself and is ignored.
+        caller = syms.resolve(ra)
+        stack = [syms.name, 'pid {}'.format(pid)]
+        if caller is not None and caller != func:
+            stack.append(caller)
+        stack.append(func)
+        folded[syms.name][';'.join(stack)] += 1
+
+    for name, counts in flat.items():
+        total = sum(counts.values())
+        print(f"\n{name}: {total} samples")
+        print(f"  {'samples':>8} {'%':>6}  function")
+        for func, count in counts.most_common(FLAT_PROFILE_LINES):
+            print(f"  {count:>8} {100 * count / total:>5.1f}%  {func}")
+
+        fname = '{}.{}.folded'.format(out_prefix, name.replace('/', '_'))
+        with open(fname, 'w') as f:
+            for stack, count in sorted(folded[name].items()):
+                f.write(f"{stack} {count}\n")
+        print(f"  folded stacks written to {fname}")
+
+
+if __name__ == '__main__':
+    if '--help' in sys.argv or len(sys.argv) != 4:
+        print("profiler.py <memory dump> <image debug info> <output prefix>\n\
+\n\
+Symbolize the samples of the kernel profiler in a memory dump (starting at\n\
+address zero). Prints a flat profile of every binary and writes its folded\n\
+stacks to <output prefix>.<binary>.folded, turn them into a flamegraph with\n\
+flamegraph.pl or open them in speedscope. The debug info is the .img.dbg\n\
+file written by package.py. Build the kernel with PROFILE_SAMPLES set.")
+    else:
+        profile(sys.argv[1], sys.argv[2], sys.argv[3])
@@ -0,0 +1,219 @@
+#include "embark.h"
+
+// ecall stubs, the arguments are already in a0 to a7 where the kernel expects
+// them. The kernel returns the error in a0 and the value in a1, which is how
+// a struct optional_int is returned.
+
+// ignore unused parameter errors only for these functions
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-parameter"
+__attribute__((naked)) struct optional_int spawn(int (*target)(void*), void* args)
+{
+    __asm__ (
+         "li a2, 0\n"
+         "li a7, 1\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int spawn_with_stack(int (*target)(void*), void* args, int stack_size)
+{
+    __asm__ (
+         "li a7, 1\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int sleep(int timeout)
+{
+    __asm__ (
+         "li a7, 2\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int join(int pid, int timeout)
+{
+    __asm__ (
+         "li a7, 3\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int kill(int pid)
+{
+    __asm__ (
+         "li a7, 4\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int set_sched(int pid, int sched_class, int param)
+{
+    __asm__ (
+         "li a7, 6\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int futex_wait(volatile int* addr, int expected, int timeout)
+{
+    __asm__ (
+         "li a7, 7\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int futex_wake(volatile int* addr, int count)
+{
+    __asm__ (
+         "li a7, 8\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int chan_create(int capacity)
+{
+    __asm__ (
+         "li a7, 9\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int chan_send(int id, int data, void* buf, int len, int timeout)
+{
+    __asm__ (
+         "li a7, 10\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int chan_close(int id)
+{
+    __asm__ (
+         "li a7, 12\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int ring_setup_raw(void* ring, int entries)
+{
+    __asm__ (
+         "li a7, 13\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int ring_enter()
+{
+    __asm__ (
+         "li a7, 14\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int sbrk(int increment)
+{
+    __asm__ (
+         "li a7, 15\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int mmap(int len)
+{
+    __asm__ (
+         "li a7, 16\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int munmap(void* addr)
+{
+    __asm__ (
+         "li a7, 17\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int set_affinity(int pid, unsigned int mask)
+{
+    __asm__ (
+         "li a7, 18\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int spawn_process(int binid, int arg)
+{
+    __asm__ (
+         "li a7, 19\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int getstats(int pid, struct sched_stats* stats)
+{
+    __asm__ (
+         "li a7, 20\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked)) struct optional_int write(int fd, char* buf, int len)
+{
+    __asm__ (
+         "li a7, 21\n"
+         "ecall\n"
+         "ret"
+    );
+    __builtin_unreachable();
+}
+
+__attribute__((naked, noreturn)) void exit(int code)
+{
+    __asm__ (
+         "li a7, 5\n"
+         "ecall"
+    );
+    __builtin_unreachable();
+}
+#pragma GCC diagnostic pop
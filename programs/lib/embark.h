@@ -0,0 +1,185 @@
+#pragma once
+
+// libembark, the runtime library for EMBARK user programs. It provides the
+// program entry point, typed wrappers for every ecall, memory and string
+// functions, number formatting and printf.
+
+typedef unsigned int size_t;
+
+#define NULL ((void*) 0)
+
+/*
+ * Types shared with the kernel, taken from the ktypes.h file
+ */
+
+enum error_code {
+    ENOCODE = 1,    // invalid syscall code
+    EINVAL  = 2,    // invalid argument value
+    ENOMEM  = 3,    // not enough memory
+    ENOBUFS = 4,    // no space left in buffer
+    ESRCH   = 5,    // no such process
+    ETIMEOUT= 6,    // timeout while waiting
+    EAGAIN  = 7,    // value changed, try again
+    EPIPE   = 8     // channel is closed
+};
+
+struct optional_int {
+    enum error_code error;
+    int value;
+};
+// has_value and has_error are not dependent on the value type
+// therefore we can define them as macros
+#define has_value(optional) (optional.error == 0)
+#define has_error(optional) (!has_value(optional))
+
+// scheduling classes
+#define SCHED_FAIR 0
+#define SCHED_FIFO 1
+
+// file descriptors of the console
+#define STDOUT 1
+#define STDERR 2
+
+// scheduler statistics, times are in mtime ticks
+struct proc_stats {
+    unsigned long long user_time;
+    unsigned long long kernel_time;
+    unsigned long long wait_time;
+    unsigned int voluntary_switches;
+    unsigned int involuntary_switches;
+    unsigned int ecalls;
+};
+
+struct sched_stats {
+    struct proc_stats proc;
+    unsigned long long idle_time;
+    unsigned long long now;
+};
+
+/*
+ * Program entry
+ *
+ * _start sets up the global pointer, calls main and exits with its return
+ * value. main receives the pid of the process and the argument it was
+ * started with by spawn_process, processes started at boot get 0.
+ */
+
+int main(int pid, int arg);
+
+/*
+ * Ecalls
+ */
+
+// start a thread running target(args), returns its pid
+struct optional_int spawn(int (*target)(void*), void* args);
+// spawn a thread with a stack of at least stack_size bytes (rounded up to a
+// power of two between 256 bytes and 64 KiB)
+struct optional_int spawn_with_stack(int (*target)(void*), void* args, int stack_size);
+// sleep for timeout time ticks
+struct optional_int sleep(int timeout);
+// wait for a process to exit and return its exit code. A timeout of 0 waits
+// forever.
+struct optional_int join(int pid, int timeout);
+// kill the process with the given pid
+struct optional_int kill(int pid);
+// exit the calling process
+__attribute__((noreturn)) void exit(int code);
+// set the scheduling class of a process (pid 0 is the caller). param is the
+// real-time priority for SCHED_FIFO and the weight for SCHED_FAIR
+struct optional_int set_sched(int pid, int sched_class, int param);
+// block until another thread calls futex_wake on addr, but only if *addr
+// still equals expected. A timeout of 0 waits forever. addr has to be in the
+// memory of the process (a stack, the binary, the heap or an mmap block).
+struct optional_int futex_wait(volatile int* addr, int expected, int timeout);
+// wake up to count threads waiting on addr, returns the number woken
+struct optional_int futex_wake(volatile int* addr, int count);
+// create a channel which buffers up to capacity (at most 8) messages, returns
+// the channel id. A capacity of 0 makes every send wait for a receiver.
+struct optional_int chan_create(int capacity);
+// send a data word and a buffer over a channel, waits while the channel is
+// full. The buffer is not copied, the receiver gets the same pointer.
+struct optional_int chan_send(int id, int data, void* buf, int len, int timeout);
+// close a channel, blocked senders and receivers fail with EPIPE. Only the
+// process that created the channel and its threads can close it, it is also
+// closed when that process exits.
+struct optional_int chan_close(int id);
+// register an ecall ring, use the ring_setup macro from ring.h
+struct optional_int ring_setup_raw(void* ring, int entries);
+// submit all queued entries, returns once all of them completed (or the
+// completion queue is full). The value is the number of completed entries.
+struct optional_int ring_enter();
+// move the end of the heap by increment bytes, returns the old end. The heap
+// is shared by all threads of a process.
+struct optional_int sbrk(int increment);
+// allocate a block of at least len bytes, it is freed when the process exits
+struct optional_int mmap(int len);
+// free a block allocated by mmap
+struct optional_int munmap(void* addr);
+// restrict a process (0 for the caller) to the harts set in mask
+struct optional_int set_affinity(int pid, unsigned int mask);
+// start a new process from the packaged binary binid, arg is passed to it in
+// a1. Returns the pid of the new process.
+struct optional_int spawn_process(int binid, int arg);
+// copy the statistics of a process (0 for the caller) into stats
+struct optional_int getstats(int pid, struct sched_stats* stats);
+// append len bytes of buf to the console output of the process, fd is 1
+// (stdout) or 2 (stderr). The kernel writes it out in whole lines, lines
+// longer than the text io buffer (TEXT_IO_BUFLEN) are split.
+struct optional_int write(int fd, char* buf, int len);
+
+// the buffer part of a received message
+struct chan_buffer {
+    void* buf;
+    int len;
+};
+
+// receive a message from a channel, waits while the channel is empty. Returns
+// the data word, the buffer is written to *msg if it is not NULL. This is not
+// a naked stub because the ecall returns the buffer in a2 and a3.
+static inline struct optional_int chan_recv(int id, int timeout, struct chan_buffer* msg)
+{
+    register int a0 __asm__ ("a0") = id;
+    register int a1 __asm__ ("a1") = timeout;
+    register int a2 __asm__ ("a2");
+    register int a3 __asm__ ("a3");
+    register int a7 __asm__ ("a7") = 11;
+
+    __asm__ volatile (
+         "ecall"
+         : "+r"(a0), "+r"(a1), "=r"(a2), "=r"(a3)
+         : "r"(a7)
+         : "memory"
+    );
+
+    if (msg != NULL) {
+        msg->buf = (void*) a2;
+        msg->len = a3;
+    }
+    return (struct optional_int) { .error = a0, .value = a1 };
+}
+
+/*
+ * Memory and strings
+ */
+
+void* memset(void* dest, int c, size_t n);
+void* memcpy(void* dest, const void* src, size_t n);
+void* memmove(void* dest, const void* src, size_t n);
+size_t strlen(const char* str);
+
+/*
+ * Formatting and output
+ */
+
+// write value in the given base (2 to 16) to str, returns the end of the
+// written digits. No terminating zero is written.
+char* itoa(int value, char* str, int base);
+char* utoa(unsigned int value, char* str, int base);
+
+// formatted output to the console, supports %d %i %u %x %p %c %s and %%
+// with an optional zero flag and field width. The output of one call is
+// written with as few write ecalls as possible, returns the number of bytes.
+int printf(const char* format, ...) __attribute__((format(printf, 1, 2)));
+
+// print len bytes of text (up to the first zero byte) followed by a newline
+void dbgln(char* text, int len);
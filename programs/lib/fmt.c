@@ -0,0 +1,223 @@
+#include "embark.h"
+#include <stdarg.h>
+
+// two digit strings for 0 to 99, base 10 conversions take one division per
+// two digits
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static const char digits[16] = "0123456789abcdef";
+
+char* utoa(unsigned int value, char* str, int base)
+{
+    // digits are produced from the end, so write them to a buffer first
+    char buf[32];
+    char* pos = buf + sizeof(buf);
+
+    if (base > 16 || base < 2) {
+        *str++ = '?';
+        return str;
+    }
+
+    if (base == 10) {
+        while (value >= 100) {
+            unsigned int pair = (value % 100) * 2;
+            value /= 100;
+            *--pos = digit_pairs[pair + 1];
+            *--pos = digit_pairs[pair];
+        }
+        if (value >= 10) {
+            *--pos = digit_pairs[value * 2 + 1];
+            *--pos = digit_pairs[value * 2];
+        } else {
+            *--pos = digits[value];
+        }
+    } else if ((base & (base - 1)) == 0) {
+        // powers of two only need shifts
+        int shift = __builtin_ctz(base);
+
+        do {
+            *--pos = digits[value & (base - 1)];
+            value >>= shift;
+        } while (value != 0);
+    } else {
+        do {
+            *--pos = digits[value % base];
+            value /= base;
+        } while (value != 0);
+    }
+
+    while (pos < buf + sizeof(buf))
+        *str++ = *pos++;
+
+    return str;
+}
+
+char* itoa(int value, char* str, int base)
+{
+    if (value < 0) {
+        *str++ = '-';
+        // negate as unsigned, so the smallest int works as well
+        return utoa(-(unsigned int) value, str, base);
+    }
+    return utoa(value, str, base);
+}
+
+void dbgln(char* text, int len)
+{
+    int end = 0;
+
+    while (end < len && text[end] != 0)
+        end++;
+
+    write(STDOUT, text, end);
+    write(STDOUT, "\n", 1);
+}
+
+/*
+ * printf
+ *
+ * the output is collected in a buffer on the stack, which is written with a
+ * single ecall when it is full and at the end.
+ */
+
+#define PRINTF_BUFFER_SIZE 128
+
+struct printf_buffer {
+    char data[PRINTF_BUFFER_SIZE];
+    int len;
+    int total;
+};
+
+static void printf_flush(struct printf_buffer* out)
+{
+    if (out->len > 0)
+        write(STDOUT, out->data, out->len);
+    out->total += out->len;
+    out->len = 0;
+}
+
+static void printf_put(struct printf_buffer* out, const char* str, int len)
+{
+    while (len > 0) {
+        if (out->len == PRINTF_BUFFER_SIZE)
+            printf_flush(out);
+
+        int count = PRINTF_BUFFER_SIZE - out->len;
+
+        if (count > len)
+            count = len;
+
+        memcpy(out->data + out->len, str, count);
+        out->len += count;
+        str += count;
+        len -= count;
+    }
+}
+
+// write str padded to width with the fill character
+static void printf_pad(struct printf_buffer* out, const char* str, int len, int width, char fill)
+{
+    // zero padding goes after the sign
+    if (fill == '0' && len > 0 && str[0] == '-') {
+        printf_put(out, str, 1);
+        str++;
+        len--;
+        width--;
+    }
+
+    for (; width > len; width--)
+        printf_put(out, &fill, 1);
+
+    printf_put(out, str, len);
+}
+
+int printf(const char* format, ...)
+{
+    struct printf_buffer out = { .len = 0, .total = 0 };
+    va_list args;
+
+    va_start(args, format);
+
+    while (*format != 0) {
+        // copy everything up to the next conversion at once
+        const char* start = format;
+
+        while (*format != 0 && *format != '%')
+            format++;
+        printf_put(&out, start, format - start);
+
+        if (*format == 0)
+            break;
+        format++;
+
+        char fill = ' ';
+        int width = 0;
+
+        if (*format == '0') {
+            fill = '0';
+            format++;
+        }
+        while (*format >= '0' && *format <= '9')
+            width = width * 10 + *format++ - '0';
+        // longs have the same size as ints
+        if (*format == 'l')
+            format++;
+
+        char num[34];
+        char* end;
+        const char* str;
+
+        switch (*format) {
+        case 'd':
+        case 'i':
+            end = itoa(va_arg(args, int), num, 10);
+            printf_pad(&out, num, end - num, width, fill);
+            break;
+        case 'u':
+            end = utoa(va_arg(args, unsigned int), num, 10);
+            printf_pad(&out, num, end - num, width, fill);
+            break;
+        case 'x':
+            end = utoa(va_arg(args, unsigned int), num, 16);
+            printf_pad(&out, num, end - num, width, fill);
+            break;
+        case 'p':
+            num[0] = '0';
+            num[1] = 'x';
+            end = utoa((unsigned int) va_arg(args, void*), num + 2, 16);
+            printf_pad(&out, num, end - num, width, ' ');
+            break;
+        case 'c':
+            num[0] = (char) va_arg(args, int);
+            printf_pad(&out, num, 1, width, ' ');
+            break;
+        case 's':
+            str = va_arg(args, const char*);
+            printf_pad(&out, str, strlen(str), width, ' ');
+            break;
+        case 0:
+            format--;
+            break;
+        default:
+            // unknown conversions and %% are printed as they are
+            printf_put(&out, format, 1);
+            break;
+        }
+        format++;
+    }
+
+    va_end(args);
+    printf_flush(&out);
+
+    return out.total;
+}
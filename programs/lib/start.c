@@ -0,0 +1,16 @@
+#include "embark.h"
+
+// the entry point of every program, the linker script puts it at the start
+// of the binary. The kernel passes the pid in a0 and the spawn argument in
+// a1, so they arrive as the arguments and are handed on to main.
+__attribute__((section(".text._start"))) void _start(int pid, int arg)
+{
+    __asm__ volatile (
+         ".option push\n"
+         ".option norelax\n"
+         "la      gp, _gp\n"
+         ".option pop\n"
+    );
+
+    exit(main(pid, arg));
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include "embark.h"
+
+// Batched ecalls. A ring is registered once with ring_setup, after that any
+// number of ecalls can be queued with ring_push and submitted together with a
+// single ring_enter trap. Results are collected with ring_pop.
+//
+// The layout is shared with the kernel, see ktypes.h.
+
+struct ring_sqe {
+    int opcode;
+    int args[4];
+    int user_data;
+};
+
+struct ring_cqe {
+    int user_data;
+    int error;
+    int value;
+    int extra[2];
+};
+
+struct ring_header {
+    volatile unsigned int sq_head;
+    volatile unsigned int sq_tail;
+    volatile unsigned int cq_head;
+    volatile unsigned int cq_tail;
+};
+
+// ecall codes which can be submitted, taken from the ecall.h file
+#define RING_OP_SPAWN       1
+#define RING_OP_SLEEP       2
+#define RING_OP_JOIN        3
+#define RING_OP_KILL        4
+#define RING_OP_FUTEX_WAKE  8
+#define RING_OP_SPAWN_PROCESS 19
+
+// define a ring with the given number of entries (power of two, at most 64)
+#define RING_DEFINE(name, n)                \
+    struct {                                \
+        struct ring_header header;          \
+        struct ring_sqe sqes[n];            \
+        struct ring_cqe cqes[n];            \
+    } name
+
+#define RING_ENTRIES(ring) (sizeof((ring).sqes) / sizeof(struct ring_sqe))
+
+
+#define ring_setup(ring) ring_setup_raw(&(ring), RING_ENTRIES(ring))
+
+// queue an ecall, returns 0 if the submission queue is full
+#define ring_push(ring, op, a0, a1, data) \
+    ring_push_raw(&(ring).header, (ring).sqes, RING_ENTRIES(ring), (op), (a0), (a1), (data))
+
+static inline int ring_push_raw(struct ring_header* hdr, struct ring_sqe* sqes, unsigned int n,
+                                int opcode, int a0, int a1, int user_data)
+{
+    if (hdr->sq_tail - hdr->sq_head == n)
+        return 0;
+
+    struct ring_sqe* sqe = &sqes[hdr->sq_tail & (n - 1)];
+
+    sqe->opcode = opcode;
+    sqe->args[0] = a0;
+    sqe->args[1] = a1;
+    sqe->args[2] = 0;
+    sqe->args[3] = 0;
+    sqe->user_data = user_data;
+    hdr->sq_tail++;
+    return 1;
+}
+
+// take a completion, returns 0 if the completion queue is empty
+#define ring_pop(ring, cqe) \
+    ring_pop_raw(&(ring).header, (ring).cqes, RING_ENTRIES(ring), (cqe))
+
+static inline int ring_pop_raw(struct ring_header* hdr, struct ring_cqe* cqes, unsigned int n,
+                               struct ring_cqe* out)
+{
+    if (hdr->cq_head == hdr->cq_tail)
+        return 0;
+
+    *out = cqes[hdr->cq_head & (n - 1)];
+    hdr->cq_head++;
+    return 1;
+}
@@ -0,0 +1,176 @@
+#pragma once
+#include "embark.h"
+
+// Locking primitives built on the futex ecalls. They use lr/sc and amo
+// instructions, so programs including this file must be compiled for a
+// target with the A extension (the Makefile uses rv32ima).
+//
+// The fast paths only use atomic instructions, the kernel is entered only
+// when a thread actually has to wait or there is a waiter to wake.
+
+/*
+ * Atomic helpers
+ */
+
+// set *addr to desired if it equals expected, returns the old value
+static inline int atomic_cas(volatile int* addr, int expected, int desired)
+{
+    int old, fail;
+
+    __asm__ volatile (
+         "1:\n"
+         "lr.w.aq   %0, (%2)\n"
+         "bne       %0, %3, 2f\n"
+         "sc.w.rl   %1, %4, (%2)\n"
+         "bnez      %1, 1b\n"
+         "2:"
+         : "=&r"(old), "=&r"(fail)
+         : "r"(addr), "r"(expected), "r"(desired)
+         : "memory"
+    );
+    return old;
+}
+
+// store val in *addr, returns the old value
+static inline int atomic_swap(volatile int* addr, int val)
+{
+    int old;
+
+    __asm__ volatile (
+         "amoswap.w.aqrl %0, %2, (%1)"
+         : "=r"(old) : "r"(addr), "r"(val) : "memory"
+    );
+    return old;
+}
+
+// add val to *addr, returns the old value
+static inline int atomic_add(volatile int* addr, int val)
+{
+    int old;
+
+    __asm__ volatile (
+         "amoadd.w.aqrl %0, %2, (%1)"
+         : "=r"(old) : "r"(addr), "r"(val) : "memory"
+    );
+    return old;
+}
+
+/*
+ * Mutex
+ *
+ * state is 0 when unlocked, 1 when locked and 2 when locked and there might
+ * be threads waiting for it.
+ */
+
+struct mutex {
+    volatile int state;
+};
+
+#define MUTEX_INIT { 0 }
+
+static inline void mutex_lock(struct mutex* m)
+{
+    int c = atomic_cas(&m->state, 0, 1);
+
+    if (c == 0)
+        return;
+
+    // mark the mutex as contended and wait until it is released
+    if (c != 2)
+        c = atomic_swap(&m->state, 2);
+
+    while (c != 0) {
+        futex_wait(&m->state, 2, 0);
+        c = atomic_swap(&m->state, 2);
+    }
+}
+
+// returns 1 if the mutex was acquired
+static inline int mutex_trylock(struct mutex* m)
+{
+    return atomic_cas(&m->state, 0, 1) == 0;
+}
+
+static inline void mutex_unlock(struct mutex* m)
+{
+    // only enter the kernel if someone might be waiting
+    if (atomic_swap(&m->state, 0) == 2)
+        futex_wake(&m->state, 1);
+}
+
+/*
+ * Condition variable
+ *
+ * seq is incremented on every signal, a waiter sleeps until it changes.
+ */
+
+struct cond {
+    volatile int seq;
+};
+
+#define COND_INIT { 0 }
+
+static inline void cond_wait(struct cond* c, struct mutex* m)
+{
+    int seq = c->seq;
+
+    mutex_unlock(m);
+    futex_wait(&c->seq, seq, 0);
+
+    // other threads might be waiting as well, so take the lock as contended
+    while (atomic_swap(&m->state, 2) != 0)
+        futex_wait(&m->state, 2, 0);
+}
+
+static inline void cond_signal(struct cond* c)
+{
+    atomic_add(&c->seq, 1);
+    futex_wake(&c->seq, 1);
+}
+
+static inline void cond_broadcast(struct cond* c)
+{
+    atomic_add(&c->seq, 1);
+    futex_wake(&c->seq, 0x7fffffff);
+}
+
+/*
+ * Semaphore
+ */
+
+struct semaphore {
+    volatile int count;
+    volatile int waiters;
+};
+
+#define SEMAPHORE_INIT(n) { (n), 0 }
+
+// returns 1 if the count could be decremented without waiting
+static inline int sem_trywait(struct semaphore* s)
+{
+    int c = s->count;
+
+    while (c > 0) {
+        int old = atomic_cas(&s->count, c, c - 1);
+        if (old == c)
+            return 1;
+        c = old;
+    }
+    return 0;
+}
+
+static inline void sem_wait(struct semaphore* s)
+{
+    while (!sem_trywait(s)) {
+        atomic_add(&s->waiters, 1);
+        futex_wait(&s->count, 0, 0);
+        atomic_add(&s->waiters, -1);
+    }
+}
+
+static inline void sem_post(struct semaphore* s)
+{
+    atomic_add(&s->count, 1);
+    if (s->waiters > 0)
+        futex_wake(&s->count, 1);
+}
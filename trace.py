@@ -0,0 +1,223 @@
+#!/usr/bin/env python3
+from typing import List, Dict, Tuple
+from bisect import bisect_right
+
+import sys
+import json
+import struct
+
+## Configuration:
+# mtime ticks per microsecond, chrome traces use microsecond timestamps
+TICKS_PER_US = 1
+
+# name of the kernel symbol holding the trace ring
+KERNEL_TRACE_RING = 'trace_ring'
+
+## end of config
+
+# struct trace_ring header: head, entries
+RING_HEADER = struct.Struct('<II')
+# struct trace_record: time, event, hart, pid, args[2]
+RECORD = struct.Struct('<QHHiii')
+
+# enum trace_event from kinclude/trace.h
+TRACE_SWITCH        = 1
+TRACE_IDLE          = 2
+TRACE_ECALL_ENTER   = 3
+TRACE_ECALL_EXIT    = 4
+TRACE_WAKE          = 5
+TRACE_SPAWN         = 6
+TRACE_EXIT          = 7
+TRACE_ALLOC         = 8
+TRACE_FREE          = 9
+
+# enum ecall_codes from kinclude/ecall.h
+ECALL_NAMES = {
+    1: 'spawn', 2: 'sleep', 3: 'join', 4: 'kill', 5: 'exit', 6: 'set_sched',
+    7: 'futex_wait', 8: 'futex_wake', 9: 'chan_create', 10: 'chan_send',
+    11: 'chan_recv', 12: 'chan_close', 13: 'ring_setup', 14: 'ring_enter',
+    15: 'sbrk', 16: 'mmap', 17: 'munmap', 18: 'set_affinity',
+    19: 'spawn_process', 20: 'getstats', 21: 'write',
+}
+
+# chrome trace process ids, every hart is a thread of the "harts" process
+HARTS_PID = 0
+PROCESSES_PID = 1
+
+
+class Record:
+    time: int
+    event: int
+    hart: int
+    pid: int
+    args: Tuple[int, int]
+
+    def __init__(self, data: bytes):
+        self.time, self.event, self.hart, self.pid, arg0, arg1 = RECORD.unpack(data)
+        self.args = (arg0, arg1)
+
+
+class Symbols:
+    """
+    Resolves kernel addresses to "kernel:symbol+offset" using the debug info
+    written by package.py. User binaries run from memory allocated at load
+    time, their symbols are offsets into an instance and are not resolved.
+    """
+    addrs: List[int]
+    names: List[str]
+    binaries: List[str]
+
+    def __init__(self, dbg: dict):
+        base = dbg.get('base', 0)
+        entries = sorted(
+            (base + addr, '{}:{}'.format(program, name))
+            for program, symbols in dbg['symbols'].items() if program == 'kernel'
+            for name, addr in symbols.items()
+        )
+        self.addrs = [addr for addr, _ in entries]
+        self.names = [name for _, name in entries]
+        # binary ids are assigned in the order package.py added the binaries
+        self.binaries = [name for name in dbg['symbols'] if name != 'kernel']
+
+    def lookup(self, name: str) -> int:
+        return self.addrs[self.names.index(name)]
+
+    def resolve(self, addr: int) -> str:
+        addr &= 0xffffffff
+        i = bisect_right(self.addrs, addr) - 1
+        if i < 0:
+            return hex(addr)
+        return '{}+{:x}'.format(self.names[i], addr - self.addrs[i])
+
+    def binary(self, binid: int) -> str:
+        if 0 < binid <= len(self.binaries):
+            return self.binaries[binid - 1]
+        return 'binary {}'.format(binid)
+
+
+def read_records(dump: bytes, ring_addr: int) -> List[Record]:
+    """
+    read the records still in the ring, oldest first
+    """
+    head, entries = RING_HEADER.unpack_from(dump, ring_addr)
+    records_addr = ring_addr + 8  # the records are 8 byte aligned
+    count = min(head, entries)
+
+    records = []
+    for i in range(head - count, head):
+        pos = records_addr + (i % entries) * RECORD.size
+        records.append(Record(dump[pos : pos + RECORD.size]))
+    return records
+
+
+def convert(records: List[Record], syms: Symbols) -> List[dict]:
+    """
+    turn trace records into chrome trace events. Every hart gets a track
+    showing which process runs on it, every process gets a track with its
+    ecalls.
+    """
+    events = []
+    # the process running on each hart, and the time it started
+    running: Dict[int, Tuple[int, int]] = dict()
+    names: Dict[int, str] = dict()
+
+    def ts(record: Record) -> float:
+        return record.time / TICKS_PER_US
+
+    def end_slice(hart: int, record: Record):
+        if hart in running:
+            pid, start = running.pop(hart)
+            events.append(dict(
+                name=names.get(pid, 'pid {}'.format(pid)) if pid else 'idle',
+                ph='X', pid=HARTS_PID, tid=hart,
+                ts=start / TICKS_PER_US, dur=(record.time - start) / TICKS_PER_US,
+            ))
+
+    def instant(record: Record, name: str, **args):
+        events.append(dict(
+            name=name, ph='i', s='t', pid=PROCESSES_PID, tid=record.pid,
+            ts=ts(record), args=args,
+        ))
+
+    for record in records:
+        event = record.event
+        if event == TRACE_SWITCH:
+            end_slice(record.hart, record)
+            running[record.hart] = (record.pid, record.time)
+            instant(record, 'resume', pc=syms.resolve(record.args[0]), queued=record.args[1])
+        elif event == TRACE_IDLE:
+            end_slice(record.hart, record)
+            running[record.hart] = (0, record.time)
+        elif event == TRACE_ECALL_ENTER:
+            events.append(dict(
+                name=ECALL_NAMES.get(record.args[0], 'ecall {}'.format(record.args[0])),
+                ph='B', pid=PROCESSES_PID, tid=record.pid, ts=ts(record),
+                args=dict(a0=record.args[1]),
+            ))
+        elif event == TRACE_ECALL_EXIT:
+            events.append(dict(
+                ph='E', pid=PROCESSES_PID, tid=record.pid, ts=ts(record),
+                args=dict(error=record.args[0], value=record.args[1]),
+            ))
+        elif event == TRACE_WAKE:
+            instant(record, 'wake', hart=record.args[0])
+        elif event == TRACE_SPAWN:
+            binid, parent = record.args
+            if binid != 0:
+                names[record.pid] = '{} ({})'.format(syms.binary(binid), record.pid)
+            else:
+                names[record.pid] = 'thread of {} ({})'.format(parent, record.pid)
+            events.append(dict(
+                name='thread_name', ph='M', pid=PROCESSES_PID, tid=record.pid,
+                args=dict(name=names[record.pid]),
+            ))
+            instant(record, 'spawn', parent=parent)
+        elif event == TRACE_EXIT:
+            instant(record, 'exit', code=record.args[0])
+        elif event in (TRACE_ALLOC, TRACE_FREE):
+            events.append(dict(
+                name='alloc' if event == TRACE_ALLOC else 'free',
+                ph='i', s='t', pid=HARTS_PID, tid=record.hart, ts=ts(record),
+                args=dict(addr=hex(record.args[0] & 0xffffffff), size=record.args[1]),
+            ))
+
+    if records:
+        for hart in list(running):
+            end_slice(hart, records[-1])
+
+    events.append(dict(name='process_name', ph='M', pid=HARTS_PID, args=dict(name='harts')))
+    events.append(dict(name='process_name', ph='M', pid=PROCESSES_PID, args=dict(name='processes')))
+    for hart in sorted(set(r.hart for r in records)):
+        events.append(dict(name='thread_name', ph='M', pid=HARTS_PID, tid=hart, args=dict(name='hart {}'.format(hart))))
+
+    return events
+
+
+def decode(dump_path: str, dbg_path: str, out: str, base: int = 0):
+    """
+    decode the trace ring in a memory dump starting at address base
+    """
+    with open(dbg_path, 'r') as f:
+        syms = Symbols(json.load(f))
+
+    with open(dump_path, 'rb') as f:
+        dump = f.read()
+
+    ring_addr = syms.lookup('kernel:' + KERNEL_TRACE_RING) - base
+    records = read_records(dump, ring_addr)
+    print(f"found {len(records)} trace records at {ring_addr + base:x}")
+
+    with open(out, 'w') as f:
+        json.dump(dict(traceEvents=convert(records, syms)), f)
+    print(f"wrote chrome trace to {out}")
+
+
+if __name__ == '__main__':
+    if '--help' in sys.argv or len(sys.argv) not in (4, 5):
+        print("trace.py <memory dump> <image debug info> <output path> [<dump base address>]\n\
+\n\
+Decode the kernel trace ring from a memory dump into a chrome trace, which\n\
+can be opened in chrome://tracing or ui.perfetto.dev. The debug info is the\n\
+.img.dbg file written by package.py. Build the kernel with TRACE_ENTRIES set.")
+    else:
+        decode(sys.argv[1], sys.argv[2], sys.argv[3], int(sys.argv[4], 0) if len(sys.argv) == 5 else 0)